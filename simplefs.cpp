@@ -1,15 +1,37 @@
 #include "simplefs.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <cstring>
+#include <new>
+#include <thread>
 #ifdef _DEBUG
 #    include <cstdio>
 #endif
 #include <lz4.h>
+#define LZ4_HC_STATIC_LINKING_ONLY
 #include <lz4hc.h>
 #include <mimalloc.h>
 #include <xxhash.h>
+#include <zdict.h>
+#include <zstd.h>
+
+#ifdef _MSC_VER
+#    define WIN32_LEAN_AND_MEAN
+#    define NOMINMAX
+#    include <windows.h>
+#else
+#    include <cerrno>
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
 
 #define SFS_MALLOC(size) ::mi_malloc(size)
+#define SFS_MALLOC_ALIGNED(size, alignment) ::mi_malloc_aligned((size), (alignment))
 #define SFS_FREE(ptr) ::mi_free(ptr)
 
 #ifdef _MSC_VER
@@ -143,10 +165,10 @@ void Array<T>::remove_at(u32 index)
 template<class T>
 void Array<T>::expand(u32 newCapacity)
 {
-    u32 capacity = capacity_;
-    while(capacity < newCapacity) {
-        capacity += 16;
-    }
+    // Grow by half at least, so that appending one at a time stays amortized constant.
+    u32 capacity = capacity_ + (capacity_ >> 1);
+    capacity = capacity < 16 ? 16 : capacity;
+    capacity = capacity < newCapacity ? newCapacity : capacity;
     T* items = (T*)SFS_MALLOC(sizeof(T) * capacity);
     for(u32 i = 0; i < size_; ++i) {
         new(&items[i]) T(items_[i]);
@@ -193,10 +215,156 @@ void* BufferPool::get(u32 size)
     return buffer_;
 }
 
+void* BufferPool::get(u32 size, u32 alignment)
+{
+    if(size<=size_ && 0 == (reinterpret_cast<std::uintptr_t>(buffer_) & (alignment-1))){
+        return buffer_;
+    }
+    SFS_FREE(buffer_);
+    size_ = (size+alignment-1) & ~(alignment-1);
+    buffer_ = SFS_MALLOC_ALIGNED(size_, alignment);
+    size_ = nullptr != buffer_ ? size_ : 0;
+    return buffer_;
+}
+
+//--- Native file
+//--------------------------------------------------------
+namespace
+{
+    inline constexpr std::intptr_t InvalidHandle = -1;
+
+    std::intptr_t open_native(const std::filesystem::path& path)
+    {
+#ifdef _MSC_VER
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return INVALID_HANDLE_VALUE == file ? InvalidHandle : reinterpret_cast<std::intptr_t>(file);
+#else
+        int fd = ::open((const char*)path.u8string().c_str(), O_RDONLY);
+        return fd < 0 ? InvalidHandle : static_cast<std::intptr_t>(fd);
+#endif
+    }
+
+    u64 size_native(std::intptr_t handle)
+    {
+#ifdef _MSC_VER
+        LARGE_INTEGER size;
+        return GetFileSizeEx(reinterpret_cast<HANDLE>(handle), &size) ? static_cast<u64>(size.QuadPart) : 0;
+#else
+        struct stat st;
+        return fstat(static_cast<int>(handle), &st) < 0 ? 0 : static_cast<u64>(st.st_size);
+#endif
+    }
+
+    void close_native(std::intptr_t handle)
+    {
+        if(InvalidHandle == handle) {
+            return;
+        }
+#ifdef _MSC_VER
+        CloseHandle(reinterpret_cast<HANDLE>(handle));
+#else
+        ::close(static_cast<int>(handle));
+#endif
+    }
+
+    /**
+     * Read exactly size bytes at offset without touching a shared file position.
+     */
+    bool read_native(std::intptr_t handle, void* dst, u64 size, u64 offset)
+    {
+        u8* d = static_cast<u8*>(dst);
+        while(0 < size) {
+#ifdef _MSC_VER
+            DWORD request = 0x4000'0000UL < size ? 0x4000'0000UL : static_cast<DWORD>(size);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD r = 0;
+            if(!ReadFile(reinterpret_cast<HANDLE>(handle), d, request, &r, &overlapped) || r <= 0) {
+                return false;
+            }
+#else
+            size_t request = 0x4000'0000UL < size ? 0x4000'0000UL : static_cast<size_t>(size);
+            ssize_t r = ::pread(static_cast<int>(handle), d, request, static_cast<off_t>(offset));
+            if(r < 0 && EINTR == errno) {
+                continue;
+            }
+            if(r <= 0) {
+                return false;
+            }
+#endif
+            d += r;
+            size -= r;
+            offset += r;
+        }
+        return true;
+    }
+
+    /**
+     * Read up to size bytes at offset, returns how many arrived, fewer at the end of the file or on an error.
+     */
+    u64 read_native_partial(std::intptr_t handle, void* dst, u64 size, u64 offset)
+    {
+        u8* d = static_cast<u8*>(dst);
+        u64 total = 0;
+        while(total < size) {
+#ifdef _MSC_VER
+            u64 rest = size - total;
+            DWORD request = 0x4000'0000UL < rest ? 0x4000'0000UL : static_cast<DWORD>(rest);
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset + total);
+            overlapped.OffsetHigh = static_cast<DWORD>((offset + total) >> 32);
+            DWORD r = 0;
+            if(!ReadFile(reinterpret_cast<HANDLE>(handle), d + total, request, &r, &overlapped) || r <= 0) {
+                break;
+            }
+#else
+            u64 rest = size - total;
+            size_t request = 0x4000'0000UL < rest ? 0x4000'0000UL : static_cast<size_t>(rest);
+            ssize_t r = ::pread(static_cast<int>(handle), d + total, request, static_cast<off_t>(offset + total));
+            if(r < 0 && EINTR == errno) {
+                continue;
+            }
+            if(r <= 0) {
+                break;
+            }
+#endif
+            total += r;
+        }
+        return total;
+    }
+} // namespace
+
 //--- Builder
 //--------------------------------------------------------
 namespace
 {
+    u64 path_hash(const void* path, size_t length)
+    {
+        return XXH64(path, length, HashSeed);
+    }
+
+    inline constexpr u32 HashChunkSize = 1024 * 1024;
+
+    /**
+     * Hash over the hash of the metadata, the hashes of the chunks of the data section and the build records.
+     */
+    u64 root_hash(u64 metadata, const Array<u64>& chunks, const Array<BuildRecord>& records)
+    {
+        XXH64_state_t* hash_state = XXH64_createState();
+        XXH64_reset(hash_state, HashSeed);
+        XXH64_update(hash_state, &metadata, sizeof(u64));
+        if(0 < chunks.size()) {
+            XXH64_update(hash_state, &chunks[0], sizeof(u64) * chunks.size());
+        }
+        if(0 < records.size()) {
+            XXH64_update(hash_state, &records[0], sizeof(BuildRecord) * records.size());
+        }
+        u64 hash = XXH64_digest(hash_state);
+        XXH64_freeState(hash_state);
+        return hash;
+    }
+
     bool is_hidden(const std::filesystem::directory_entry& entry)
     {
         return entry.path().filename() == "."
@@ -239,10 +407,37 @@ bool Builder::build(const char* root, const char* outfile, const Param& param)
     files_.clear();
     names_.clear();
     filepath_.clear();
+    mtimes_.clear();
+    report_ = {};
     files_.resize(1);
     filepath_.resize(1);
+    mtimes_.resize(1);
     add_directory(0, root_entry, u8"");
-    return compress(outfile, param);
+    if(nullptr == param.previous_) {
+        return compress(outfile, param, nullptr);
+    }
+
+    // A previous archive which cannot be opened only means that everything is compressed again.
+    PacFS previous;
+    bool has_previous = previous.open(param.previous_);
+    std::error_code error;
+    path out(outfile);
+    path temp(outfile);
+    if(has_previous && equivalent(path(param.previous_), out, error)) {
+        temp += ".tmp";
+    }
+    bool result = compress((const char*)temp.u8string().c_str(), param, has_previous ? &previous : nullptr);
+    previous.close();
+    if(result && temp != out) {
+        rename(temp, out, error);
+        result = !error;
+    }
+    return result;
+}
+
+const Builder::Report& Builder::report() const
+{
+    return report_;
 }
 
 void Builder::add_file(u32 index, const std::filesystem::directory_entry& entry)
@@ -250,7 +445,7 @@ void Builder::add_file(u32 index, const std::filesystem::directory_entry& entry)
     assert(index < files_.size());
     std::u8string name = entry.path().filename().u8string();
     File& file = files_[index];
-    file.size_offset_.original_size_ = static_cast<u32>(entry.file_size());
+    file.size_offset_.original_size_ = entry.file_size();
     file.size_offset_.offset_ = 0;
     file.name_offset_ = static_cast<u32>(names_.size());
     file.name_length_ = static_cast<u16>(name.length());
@@ -260,6 +455,10 @@ void Builder::add_file(u32 index, const std::filesystem::directory_entry& entry)
         names_.push_back(name[i]);
     }
     filepath_[index] = std::filesystem::absolute(entry.path());
+    // An unknown write time is 0, such files are always hashed before reuse.
+    std::error_code error;
+    std::filesystem::file_time_type mtime = entry.last_write_time(error);
+    mtimes_[index] = error ? 0 : static_cast<s64>(mtime.time_since_epoch().count());
 #ifdef _DEBUG
     printf("file %s: size:%lld\n", (const char*)filepath_[index].u8string().c_str(), entry.file_size());
 #endif
@@ -269,12 +468,19 @@ void Builder::add_directory(u32 index, const std::filesystem::directory_entry& e
 {
     assert(index < files_.size());
     using namespace std::filesystem;
-    u32 num_children = 0;
+    Array<directory_entry> children;
     for(const directory_entry& x: directory_iterator(entry)) {
         if((x.is_regular_file() || x.is_directory()) && !is_hidden(x)) {
-            ++num_children;
+            children.push_back(x);
         }
     }
+    // Sort by name, PacFS binary searches children and the layout no longer depends on the directory order.
+    if(1 < children.size()) {
+        std::sort(&children[0], &children[0] + children.size(), [](const directory_entry& x0, const directory_entry& x1) {
+            return x0.path().filename().u8string() < x1.path().filename().u8string();
+        });
+    }
+    u32 num_children = children.size();
 
     File& file = files_[index];
     file.children_.num_children_ = num_children;
@@ -293,192 +499,1666 @@ void Builder::add_directory(u32 index, const std::filesystem::directory_entry& e
     u64 newSize = file.children_.child_start_ + num_children;
     files_.resize(newSize);
     filepath_.resize(newSize);
+    mtimes_.resize(newSize);
     index = files_[index].children_.child_start_;
-    for(const directory_entry& x: directory_iterator(entry)) {
-        if(is_hidden(x)) {
-            continue;
-        }
+    for(u32 i = 0; i < children.size(); ++i) {
+        const directory_entry& x = children[i];
         if(x.is_regular_file()) {
             add_file(index, x);
-        } else if(x.is_directory()) {
+        } else {
             add_directory(index, x, x.path().filename().u8string());
         }
         ++index;
     }
 }
 
+void Builder::build_path_index(Array<PathSlot>& slots) const
+{
+    slots.clear();
+    if(files_.size() <= 1) {
+        return;
+    }
+    u32 num_slots = 2;
+    while(num_slots < (files_.size() - 1) * 2) {
+        num_slots <<= 1;
+    }
+    slots.resize(num_slots);
+    u32 mask = num_slots - 1;
+    for(u32 i = 1; i < files_.size(); ++i) {
+        std::u8string path = filepath_[i].lexically_relative(filepath_[0]).generic_u8string();
+        u64 hash = path_hash(path.c_str(), path.length());
+        u32 slot = static_cast<u32>(hash) & mask;
+        while(0 != slots[slot].index_) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot].hash_ = hash;
+        slots[slot].index_ = i;
+    }
+}
+
 namespace
 {
-    bool compress_internal(File& entry, const std::filesystem::path& filepath, u64& data_offset, FILE* archive, const Builder::Param& param)
+    enum class UnitType : u8
     {
-        assert(nullptr != archive);
-        assert(entry.size_offset_.original_size_ <= 0x7FFF'FFFFUL);
-#ifdef _MSC_VER
-        FILE* file = nullptr;
-        fopen_s(&file, (const char*)filepath.u8string().c_str(), "rb");
-#else
-        FILE* file = fopen((const char*)filepath.u8string().c_str(), "rb");
-#endif
-        if(nullptr == file) {
-            return false;
+        Raw = 0, //!< stored as is
+        Whole,   //!< a whole file compressed at once
+        Block,   //!< one block of a blocked entry
+        Copy,    //!< stored bytes of an entry of a previous archive
+        Solid,   //!< small files of a directory compressed together
+    };
+
+    /**
+     * Piece of a file travelling from the reader through the workers to the writer.
+     */
+    struct Unit
+    {
+        u32 entry_;
+        u32 size_;
+        u32 encoded_size_;
+        UnitType type_;
+        u8 compression_; //!< compression of a copied entry
+        u8 rejected_;    //!< compression which missed the ratio, the unit is then stored raw
+        u8 ratio_;       //!< percent the rejected compression reached
+        s32 level_;      //!< codec level of the entry
+        bool first_;
+        bool last_;
+        bool ready_;
+        bool result_;
+        u64 checksum_;   //!< checksum of the entry, set on the last unit
+        u64 cost_;       //!< bytes counted against Builder::Param::memory_limit_
+        u8* bytes_;
+        u8* encoded_; //!< may alias bytes_
+    };
+
+    /**
+     * Grouping of small files into solid blocks, members of a group are siblings in index order.
+     */
+    struct SolidPlan
+    {
+        Array<u32> group_;   //!< group of each entry plus one, 0 if the entry is stored on its own
+        Array<u32> start_;   //!< first member of each group in members_, one past the last group at the end
+        Array<u32> members_;
+    };
+
+    bool match_glob(const char* pattern, const char* path)
+    {
+        while('\0' != *pattern) {
+            if('*' == *pattern) {
+                bool deep = '*' == pattern[1];
+                pattern += deep ? 2 : 1;
+                for(;; ++path) {
+                    if(match_glob(pattern, path)) {
+                        return true;
+                    }
+                    if('\0' == *path || (!deep && '/' == *path)) {
+                        return false;
+                    }
+                }
+            }
+            bool any = '?' == *pattern && '/' != *path;
+            if('\0' == *path || (!any && *pattern != *path)) {
+                return false;
+            }
+            ++pattern;
+            ++path;
         }
-        u8* bytes = static_cast<u8*>(SFS_MALLOC(entry.size_offset_.original_size_));
-        if(nullptr == bytes) {
-            fclose(file);
-            return false;
+        return '\0' == *path;
+    }
+
+    /**
+     * Find the rule of each entry, 0 if none matches, otherwise the index of the rule plus one.
+     */
+    void match_rules(const Array<File>& files, const Array<std::filesystem::path>& filepath, const Builder::Param& param, Array<u32>& rules)
+    {
+        rules.resize(files.size());
+        for(u32 i = 0; i < files.size(); ++i) {
+            rules[i] = 0;
+            if(static_cast<u8>(Type::File) != files[i].type_ || nullptr == param.rules_) {
+                continue;
+            }
+            std::u8string path = filepath[i].lexically_relative(filepath[0]).generic_u8string();
+            std::u8string name = filepath[i].filename().generic_u8string();
+            for(u32 j = 0; j < param.num_rules_; ++j) {
+                const char* pattern = param.rules_[j].pattern_;
+                if(nullptr == pattern) {
+                    continue;
+                }
+                const char8_t* target = nullptr == ::strchr(pattern, '/') ? name.c_str() : path.c_str();
+                if(match_glob(pattern, (const char*)target)) {
+                    rules[i] = j + 1;
+                    break;
+                }
+            }
         }
-        if(fread(bytes, entry.size_offset_.original_size_, 1, file) <= 0) {
-            SFS_FREE(bytes);
-            fclose(file);
-            return false;
+    }
+
+    /**
+     * Parameters of an entry, the codec and the level of its rule replace the global ones.
+     */
+    Builder::Param entry_param(const Builder::Param& param, const Array<u32>& rules, u32 index)
+    {
+        Builder::Param result = param;
+        if(0 < rules[index]) {
+            const Builder::Rule& rule = param.rules_[rules[index] - 1];
+            result.compression_ = rule.compression_;
+            result.level_ = rule.level_;
         }
-        fclose(file);
-        if(param.compression_ == Compression::Raw || entry.size_offset_.original_size_ <= param.minimum_size_to_compress_) {
-            if(fwrite(bytes, entry.size_offset_.original_size_, 1, archive) <= 0) {
-                SFS_FREE(bytes);
-                return false;
-            }
-            entry.size_offset_.offset_ = data_offset;
-            entry.size_offset_.compressed_size_ = entry.size_offset_.original_size_;
-            entry.compression_ = (uint8_t)Compression::Raw;
-            data_offset += entry.size_offset_.original_size_;
-        } else {
-            int32_t size_bound = LZ4_compressBound((int32_t)entry.size_offset_.original_size_);
-            char* dst = static_cast<char*>(SFS_MALLOC(size_bound));
-            if(nullptr == dst) {
-                SFS_FREE(bytes);
-                return false;
+        return result;
+    }
+
+    void plan_solid_blocks(const Array<File>& files, const Builder::Param& param, const Array<u32>& duplicates, const Array<u32>& rules, SolidPlan& plan)
+    {
+        plan.group_.resize(files.size());
+        for(u32 i = 0; i < files.size(); ++i) {
+            plan.group_[i] = 0;
+        }
+        plan.start_.push_back(0);
+        if(param.solid_size_ <= 0 || Compression::Raw == param.compression_) {
+            return;
+        }
+        for(u32 i = 0; i < files.size(); ++i) {
+            if(static_cast<u8>(Type::Directory) != files[i].type_) {
+                continue;
             }
-            int32_t compressed_size = LZ4_compress_HC((const char*)bytes, (char*)dst, (int32_t)entry.size_offset_.original_size_, size_bound, LZ4HC_CLEVEL_OPT_MIN);
-            if(0 == compressed_size) {
-                SFS_FREE(dst);
-                SFS_FREE(bytes);
-                return false;
+            u32 begin = static_cast<u32>(files[i].children_.child_start_);
+            u32 end = begin + static_cast<u32>(files[i].children_.num_children_);
+            u32 first = plan.members_.size();
+            u32 size = 0;
+            for(u32 j = begin; j <= end; ++j) {
+                bool eligible = false;
+                u32 file_size = 0;
+                if(j < end && static_cast<u8>(Type::File) == files[j].type_ && 0 == duplicates[j] && 0 == rules[j]) {
+                    u64 entry_size = files[j].size_offset_.original_size_;
+                    eligible = 0 < entry_size && entry_size <= param.solid_size_;
+                    file_size = eligible ? static_cast<u32>(entry_size) : 0;
+                }
+                // Close the group at the end of the directory or when the next member does not fit.
+                if(end == j || (eligible && param.solid_block_size_ < size + file_size)) {
+                    u32 count = plan.members_.size() - first;
+                    if(1 < count) {
+                        for(u32 k = first; k < plan.members_.size(); ++k) {
+                            plan.group_[plan.members_[k]] = plan.start_.size();
+                        }
+                        plan.start_.push_back(plan.members_.size());
+                    } else {
+                        plan.members_.resize(first);
+                    }
+                    first = plan.members_.size();
+                    size = 0;
+                }
+                if(eligible) {
+                    plan.members_.push_back(j);
+                    size += file_size;
+                }
             }
-            if(fwrite(dst, compressed_size, 1, archive) <= 0) {
-                SFS_FREE(dst);
-                SFS_FREE(bytes);
+        }
+    }
+
+    enum class ChunkState : u8
+    {
+        Unchecked = 0,
+        Intact,
+        Damaged,
+    };
+
+    /**
+     * Entries of a previous archive which are copied instead of compressed again when their contents did not change.
+     */
+    struct Previous
+    {
+        std::intptr_t file_;
+        u64 data_;
+        u64 data_size_;
+        u64 chunk_size_;
+        Array<u64> chunks_;          //!< chunk hashes of the data section, checked against the root hash
+        Array<ChunkState> checked_;  //!< state of each chunk
+        const File* files_;
+        Array<BuildRecord> records_; //!< build record of each entry of the previous archive
+        Array<const File*> entries_; //!< candidate for each entry of the new archive, nullptr if there is none
+
+        const BuildRecord& record(const File& entry) const
+        {
+            return records_[static_cast<u32>(std::distance(files_, &entry))];
+        }
+    };
+
+    inline constexpr u32 CopyChunkSize = 256 * 1024;
+
+    /**
+     * Largest entry which is compressed at once, larger files without blocks are stored as is.
+     */
+    inline constexpr u64 MaxWholeSize = LZ4_MAX_INPUT_SIZE;
+
+    inline constexpr u32 MinBlockSize = 4 * 1024;
+    inline constexpr u32 StreamBlockSize = 1024 * 1024; //!< block size under a memory limit when blocks are disabled
+    inline constexpr u32 UnitsPerLimit = 8; //!< buffers of a block which fit in the memory limit
+    inline constexpr u32 RatioSampleSize = 64 * 1024; //!< bytes of the first block sampled against Builder::Param::maximum_ratio_
+    inline constexpr u32 MaxAlignment = 2 * 1024 * 1024;
+    inline constexpr u8 Zeros[4096] = {};
+
+    /**
+     * Alignment of the archive, the requested one rounded up to a power of two.
+     */
+    u32 data_alignment(const Builder::Param& param)
+    {
+        if(param.alignment_ <= 1) {
+            return 0;
+        }
+        u32 alignment = 2;
+        while(alignment < param.alignment_ && alignment < MaxAlignment) {
+            alignment <<= 1;
+        }
+        return alignment;
+    }
+
+    u32 log2(u32 x)
+    {
+        u32 shift = 0;
+        while(1U < (x >> shift)) {
+            ++shift;
+        }
+        return shift;
+    }
+
+    /**
+     * Write padding, the zeros are fed to the hash like any other bytes.
+     */
+    template<class Hash>
+    bool write_zeros(FILE* file, u64 size, Hash&& hash)
+    {
+        while(0 < size) {
+            u64 chunk = size < sizeof(Zeros) ? size : sizeof(Zeros);
+            if(fwrite(Zeros, static_cast<size_t>(chunk), 1, file) <= 0) {
                 return false;
             }
-            entry.size_offset_.offset_ = data_offset;
-            entry.size_offset_.compressed_size_ = compressed_size;
-            entry.compression_ = (uint8_t)Compression::LZ4;
-            data_offset += compressed_size;
-            SFS_FREE(dst);
+            hash(Zeros, chunk);
+            size -= chunk;
         }
-        SFS_FREE(bytes);
         return true;
     }
-} // namespace
 
-bool Builder::compress(const char* file, const Param& param)
-{
-    assert(nullptr != file);
-#ifdef _MSC_VER
-    FILE* f = nullptr;
-    fopen_s(&f, file, "w+b");
-#else
-    FILE* f = fopen(file, "w+b");
-#endif
-    if(nullptr == f) {
-        return false;
-    }
-    Header header = {};
-    header.magic_ = Magic;
-    header.num_entries_ = static_cast<u32>(files_.size());
-    header.name_ = sizeof(Header) + static_cast<u32>(sizeof(File) * files_.size());
-    header.data_ = header.name_ + static_cast<u32>(names_.size());
-    if(::fwrite(&header, sizeof(Header), 1, f) <= 0) {
-        fclose(f);
-        return false;
+    /**
+     * Block size of the archive.
+     * A memory limit splits every file which does not fit into blocks, then no unit holds more than a share of the limit.
+     */
+    u32 archive_block_size(const Builder::Param& param)
+    {
+        if(param.memory_limit_ <= 0) {
+            return param.block_size_;
+        }
+        u64 share = param.memory_limit_ / UnitsPerLimit;
+        u64 size = 0 < param.block_size_ ? param.block_size_ : StreamBlockSize;
+        size = share < size ? share : size;
+        return static_cast<u32>(size < MinBlockSize ? MinBlockSize : size);
     }
-    if(::fwrite(&files_[0], sizeof(File) * files_.size(), 1, f) <= 0) {
-        fclose(f);
-        return false;
+
+    /**
+     * Bytes of the input and the compressed copy of a unit.
+     */
+    u64 unit_cost(UnitType type, Compression compression, u32 size)
+    {
+        if(UnitType::Raw == type || UnitType::Copy == type) {
+            return size;
+        }
+        u64 bound = Compression::Zstd == compression ? ZSTD_compressBound(size) : static_cast<u64>(LZ4_compressBound(static_cast<int32_t>(size)));
+        return size + bound;
     }
-    if(::fwrite(&names_[0], names_.size(), 1, f) <= 0) {
-        fclose(f);
-        return false;
+
+    /**
+     * LZ4HC level of Builder::Param::level_, the fast modes do not apply to dictionary compression.
+     */
+    s32 hc_level(s32 level)
+    {
+        return 0 < level ? level : LZ4HC_CLEVEL_OPT_MIN;
     }
 
-    u64 data_offset = 0;
-    for(u32 i = 0; i < files_.size(); ++i) {
-        if(static_cast<u8>(Type::Directory) == files_[i].type_) {
-            continue;
-        }
-        File& entry = files_[i];
-        if(!compress_internal(entry, filepath_[i], data_offset, f, param)) {
-            fclose(f);
-            return false;
+    /**
+     * Level an entry is actually compressed with, which tells whether a previous build used the same settings.
+     */
+    s16 entry_level(u8 compression, s32 level)
+    {
+        switch(static_cast<Compression>(compression & CompressionMask)) {
+        case Compression::LZ4:
+            level = (level < 0 && 0 == (compression & static_cast<u8>(CompressionFlag::Dictionary))) ? level : hc_level(level);
+            break;
+        case Compression::Zstd:
+            level = 0 != level ? level : ZSTD_CLEVEL_DEFAULT;
+            break;
+        default:
+            return 0;
         }
+        level = level < INT16_MIN ? INT16_MIN : level;
+        return static_cast<s16>(INT16_MAX < level ? INT16_MAX : level);
     }
-    fflush(f);
-    XXH64_state_t* hash_state = XXH64_createState();
-    XXH64_reset(hash_state, HashSeed);
-    fseek(f, sizeof(Header), SEEK_SET);
-    for(;;){
-        static constexpr size_t BufferSize = 16*1024;
-        char buffer[BufferSize];
-        size_t r = fread(buffer, 1, BufferSize, f);
-        if(ferror(f)){
-            XXH64_freeState(hash_state);
-            fclose(f);
-            return false;
+
+    /**
+     * How a file is stored, with a dictionary files below Builder::Param::minimum_size_to_compress_ are compressed too.
+     */
+    UnitType classify(u64 size, const Builder::Param& param, bool dictionary)
+    {
+        if(param.compression_ == Compression::Raw) {
+            return UnitType::Raw;
         }
-        if(0<r){
-            XXH64_update(hash_state, buffer, r);
+        if(size <= param.minimum_size_to_compress_) {
+            return dictionary && 0 < size && size <= param.dictionary_threshold_ ? UnitType::Whole : UnitType::Raw;
         }
-        if(feof(f)){
-            break;
+        u32 blocks = archive_block_size(param);
+        if(0 < blocks && blocks < size) {
+            return UnitType::Block;
         }
+        return size <= MaxWholeSize ? UnitType::Whole : UnitType::Raw;
     }
 
-    header.hash_ = XXH64_digest(hash_state);
-    XXH64_freeState(hash_state);
-    hash_state = nullptr;
-    fseek(f, 0, SEEK_SET);
-    if(::fwrite(&header, sizeof(Header), 1, f) <= 0) {
-        return false;
+    /**
+     * Whether a compressed size is within Builder::Param::maximum_ratio_ of the original.
+     */
+    bool meets_ratio(u64 compressed_size, u64 size, const Builder::Param& param)
+    {
+        return param.maximum_ratio_ <= 0 || compressed_size * 100 <= size * param.maximum_ratio_;
     }
-    if(::fwrite(&files_[0], sizeof(File) * files_.size(), 1, f) <= 0) {
-        return false;
+
+    /**
+     * Percent of the original size, rounded up so that it exceeds Builder::Param::maximum_ratio_ exactly when meets_ratio fails.
+     */
+    u8 percent(u64 compressed_size, u64 size)
+    {
+        u64 ratio = 0 < size ? (compressed_size * 100 + size - 1) / size : 0;
+        return static_cast<u8>(255 < ratio ? 255 : ratio);
     }
-    fclose(f);
-    return true;
-}
 
-//--- DirectoryIterator
-//-------------------------------------------------------------------
-DirectoryIterator::DirectoryIterator(IFile* parent, IFile* file, u32 index)
-    : parent_(parent)
-    , file_(file)
-    , index_(index)
-{
-    assert(nullptr != parent_);
-}
+    /**
+     * Estimate whether a blocked entry meets the ratio from a sample of its first block.
+     * The sample is compressed with fast LZ4 whatever the codec, it only has to tell media from text.
+     */
+    bool compressible(const u8* bytes, u32 size, const Builder::Param& param, u8& ratio)
+    {
+        if(param.maximum_ratio_ <= 0) {
+            return true;
+        }
+        u32 sample = size < RatioSampleSize ? size : RatioSampleSize;
+        int32_t bound = LZ4_compressBound(static_cast<int32_t>(sample));
+        char* encoded = static_cast<char*>(SFS_MALLOC(bound));
+        if(nullptr == encoded) {
+            return true;
+        }
+        int32_t compressed_size = LZ4_compress_default((const char*)bytes, encoded, static_cast<int32_t>(sample), bound);
+        SFS_FREE(encoded);
+        ratio = percent(static_cast<u64>(0 < compressed_size ? compressed_size : bound), sample);
+        return 0 < compressed_size && meets_ratio(static_cast<u64>(compressed_size), sample, param);
+    }
 
-DirectoryIterator::~DirectoryIterator()
-{
-    parent_ = nullptr;
-    if(nullptr != file_) {
-        file_->close();
-        file_ = nullptr;
+    /**
+     * Whether a whole unit compressed with the dictionary is kept as is, small files may not shrink even with it.
+     */
+    bool stored_raw(const Unit& unit, u64 compressed_size)
+    {
+        return UnitType::Whole == unit.type_ && 0 != (unit.compression_ & static_cast<u8>(CompressionFlag::Dictionary)) && unit.size_ <= compressed_size;
     }
-    index_ = 0;
-}
 
-DirectoryIterator::DirectoryIterator(DirectoryIterator&& other)
-    : parent_(other.parent_)
-    , file_(other.file_)
-    , index_(other.index_)
-{
-    other.parent_ = nullptr;
-    other.file_ = nullptr;
-    other.index_ = 0;
-}
+    u8 to_compression(UnitType type, Compression compression)
+    {
+        switch(type) {
+        case UnitType::Whole:
+            return static_cast<u8>(compression);
+        case UnitType::Block:
+            return static_cast<u8>(compression) | static_cast<u8>(CompressionFlag::Blocked);
+        default:
+            return static_cast<u8>(Compression::Raw);
+        }
+    }
 
-DirectoryIterator& DirectoryIterator::operator=(DirectoryIterator&& other)
-{
+    u8 entry_compression(u64 size, const Builder::Param& param, bool dictionary)
+    {
+        UnitType type = classify(size, param, dictionary);
+        u8 compression = to_compression(type, param.compression_);
+        if(dictionary && UnitType::Whole == type && size <= param.dictionary_threshold_) {
+            compression |= static_cast<u8>(CompressionFlag::Dictionary);
+        }
+        return compression;
+    }
+
+    /**
+     * Train the dictionary on the entries which are compressed with it.
+     * Samples are taken in index order up to a hundred times the dictionary size, which keeps builds reproducible.
+     */
+    void train_dictionary(const Array<File>& files, const Array<std::filesystem::path>& filepath, const Builder::Param& param, const Array<u32>& duplicates, const Array<u32>& rules, const SolidPlan& solid, Array<u8>& dictionary)
+    {
+        dictionary.clear();
+        if(param.dictionary_size_ <= 0 || Compression::Raw == param.compression_) {
+            return;
+        }
+        u64 budget = static_cast<u64>(param.dictionary_size_) * 100;
+        u64 total = 0;
+        Array<u32> samples;
+        for(u32 i = 1; i < files.size() && total < budget; ++i) {
+            u64 size = files[i].size_offset_.original_size_;
+            if(static_cast<u8>(Type::File) != files[i].type_ || 0 < duplicates[i] || 0 < rules[i] || 0 < solid.group_[i] || budget < total + size) {
+                continue;
+            }
+            if(0 == (entry_compression(size, param, true) & static_cast<u8>(CompressionFlag::Dictionary))) {
+                continue;
+            }
+            samples.push_back(i);
+            total += size;
+        }
+        if(samples.size() <= 0) {
+            return;
+        }
+        Array<u8> buffer;
+        Array<size_t> sizes;
+        buffer.resize(static_cast<u32>(total));
+        u32 offset = 0;
+        for(u32 i = 0; i < samples.size(); ++i) {
+            u32 size = static_cast<u32>(files[samples[i]].size_offset_.original_size_);
+#ifdef _MSC_VER
+            FILE* file = nullptr;
+            fopen_s(&file, (const char*)filepath[samples[i]].u8string().c_str(), "rb");
+#else
+            FILE* file = fopen((const char*)filepath[samples[i]].u8string().c_str(), "rb");
+#endif
+            if(nullptr == file) {
+                continue;
+            }
+            if(fread(&buffer[offset], size, 1, file) == 1) {
+                sizes.push_back(size);
+                offset += size;
+            }
+            fclose(file);
+        }
+        if(sizes.size() <= 0) {
+            return;
+        }
+        // Too few or too uniform samples make training fail, the archive is then built without a dictionary.
+        dictionary.resize(param.dictionary_size_);
+        size_t size = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(), &buffer[0], &sizes[0], sizes.size());
+        if(ZDICT_isError(size)) {
+            dictionary.clear();
+            return;
+        }
+        dictionary.resize(static_cast<u32>(size));
+    }
+
+    bool hash_file(const std::filesystem::path& filepath, u64& checksum)
+    {
+#ifdef _MSC_VER
+        FILE* file = nullptr;
+        fopen_s(&file, (const char*)filepath.u8string().c_str(), "rb");
+#else
+        FILE* file = fopen((const char*)filepath.u8string().c_str(), "rb");
+#endif
+        if(nullptr == file) {
+            return false;
+        }
+        u8* buffer = static_cast<u8*>(SFS_MALLOC(CopyChunkSize));
+        XXH64_state_t* hash_state = XXH64_createState();
+        XXH64_reset(hash_state, HashSeed);
+        bool result = nullptr != buffer;
+        while(result) {
+            size_t r = fread(buffer, 1, CopyChunkSize, file);
+            XXH64_update(hash_state, buffer, r);
+            if(r < CopyChunkSize) {
+                result = 0 == ferror(file);
+                break;
+            }
+        }
+        checksum = XXH64_digest(hash_state);
+        XXH64_freeState(hash_state);
+        SFS_FREE(buffer);
+        fclose(file);
+        return result;
+    }
+
+    bool same_contents(const std::filesystem::path& filepath0, const std::filesystem::path& filepath1)
+    {
+#ifdef _MSC_VER
+        FILE* file0 = nullptr;
+        FILE* file1 = nullptr;
+        fopen_s(&file0, (const char*)filepath0.u8string().c_str(), "rb");
+        fopen_s(&file1, (const char*)filepath1.u8string().c_str(), "rb");
+#else
+        FILE* file0 = fopen((const char*)filepath0.u8string().c_str(), "rb");
+        FILE* file1 = fopen((const char*)filepath1.u8string().c_str(), "rb");
+#endif
+        u8* buffer = static_cast<u8*>(SFS_MALLOC(CopyChunkSize * 2));
+        bool result = nullptr != file0 && nullptr != file1 && nullptr != buffer;
+        while(result) {
+            size_t r0 = fread(buffer, 1, CopyChunkSize, file0);
+            size_t r1 = fread(buffer + CopyChunkSize, 1, CopyChunkSize, file1);
+            result = r0 == r1 && 0 == ::memcmp(buffer, buffer + CopyChunkSize, r0);
+            if(r0 < CopyChunkSize) {
+                result = result && 0 == ferror(file0) && 0 == ferror(file1);
+                break;
+            }
+        }
+        SFS_FREE(buffer);
+        if(nullptr != file1) {
+            fclose(file1);
+        }
+        if(nullptr != file0) {
+            fclose(file0);
+        }
+        return result;
+    }
+
+    /**
+     * Find files whose contents equal those of an earlier entry.
+     * Only files of the same size are hashed, candidates which share the checksum too are then compared byte by byte, the earliest entry keeps the data.
+     * @param duplicates original of each entry, 0 if the entry stores its own data
+     * @param checksums checksum of each hashed entry for the reader, 0 if the entry was not hashed
+     */
+    void find_duplicates(const Array<File>& files, const Array<std::filesystem::path>& filepath, const Builder::Param& param, Array<u32>& duplicates, Array<u64>& checksums)
+    {
+        duplicates.resize(files.size());
+        checksums.resize(files.size());
+        for(u32 i = 0; i < files.size(); ++i) {
+            duplicates[i] = 0;
+            checksums[i] = 0;
+        }
+        if(!param.deduplicate_) {
+            return;
+        }
+        struct Content
+        {
+            u64 checksum_;
+            u64 size_;
+            u32 index_;
+        };
+        Array<Content> sized;
+        for(u32 i = 1; i < files.size(); ++i) {
+            if(static_cast<u8>(Type::File) != files[i].type_ || files[i].size_offset_.original_size_ <= 0) {
+                continue;
+            }
+            sized.push_back({0, files[i].size_offset_.original_size_, i});
+        }
+        if(sized.size() <= 1) {
+            return;
+        }
+        std::sort(&sized[0], &sized[0] + sized.size(), [](const Content& x0, const Content& x1) {
+            return x0.size_ != x1.size_ ? x0.size_ < x1.size_ : x0.index_ < x1.index_;
+        });
+        // A file with a size of its own cannot have a duplicate, its contents are left to the reader.
+        Array<Content> contents;
+        for(u32 i = 0; i < sized.size(); ++i) {
+            bool shared = (0 < i && sized[i - 1].size_ == sized[i].size_) || (i + 1 < sized.size() && sized[i + 1].size_ == sized[i].size_);
+            if(shared && hash_file(filepath[sized[i].index_], sized[i].checksum_)) {
+                checksums[sized[i].index_] = sized[i].checksum_;
+                contents.push_back(sized[i]);
+            }
+        }
+        if(contents.size() <= 1) {
+            return;
+        }
+        std::sort(&contents[0], &contents[0] + contents.size(), [](const Content& x0, const Content& x1) {
+            if(x0.size_ != x1.size_) {
+                return x0.size_ < x1.size_;
+            }
+            if(x0.checksum_ != x1.checksum_) {
+                return x0.checksum_ < x1.checksum_;
+            }
+            return x0.index_ < x1.index_;
+        });
+        u32 first = 0;
+        for(u32 i = 1; i < contents.size(); ++i) {
+            if(contents[i].size_ != contents[first].size_ || contents[i].checksum_ != contents[first].checksum_) {
+                first = i;
+                continue;
+            }
+            // A hash collision keeps its own data.
+            if(same_contents(filepath[contents[first].index_], filepath[contents[i].index_])) {
+                duplicates[contents[i].index_] = contents[first].index_;
+            }
+        }
+    }
+
+    /**
+     * Hashes of consecutive HashChunkSize pieces of the data section, fed in file order.
+     */
+    class ChunkHash
+    {
+    public:
+        ChunkHash();
+        ~ChunkHash();
+
+        void update(const void* data, u64 size);
+        void finish();
+        const Array<u64>& hashes() const;
+
+    private:
+        ChunkHash(const ChunkHash&) = delete;
+        ChunkHash& operator=(const ChunkHash&) = delete;
+
+        XXH64_state_t* hash_state_;
+        u64 filled_;
+        Array<u64> hashes_;
+    };
+
+    ChunkHash::ChunkHash()
+        : hash_state_(XXH64_createState())
+        , filled_(0)
+    {
+        XXH64_reset(hash_state_, HashSeed);
+    }
+
+    ChunkHash::~ChunkHash()
+    {
+        XXH64_freeState(hash_state_);
+    }
+
+    void ChunkHash::update(const void* data, u64 size)
+    {
+        const u8* d = static_cast<const u8*>(data);
+        while(0 < size) {
+            u64 chunk = (HashChunkSize - filled_) < size ? HashChunkSize - filled_ : size;
+            XXH64_update(hash_state_, d, static_cast<size_t>(chunk));
+            d += chunk;
+            size -= chunk;
+            filled_ += chunk;
+            if(HashChunkSize <= filled_) {
+                hashes_.push_back(XXH64_digest(hash_state_));
+                XXH64_reset(hash_state_, HashSeed);
+                filled_ = 0;
+            }
+        }
+    }
+
+    void ChunkHash::finish()
+    {
+        if(0 < filled_) {
+            hashes_.push_back(XXH64_digest(hash_state_));
+            XXH64_reset(hash_state_, HashSeed);
+            filled_ = 0;
+        }
+    }
+
+    const Array<u64>& ChunkHash::hashes() const
+    {
+        return hashes_;
+    }
+
+    /**
+     * Order in which the entries are stored, files of the trace first in the order of their first access, the rest in index order.
+     * A trace which cannot be read only means that everything keeps index order.
+     */
+    void plan_order(const Array<File>& files, const Array<std::filesystem::path>& filepath, const Builder::Param& param, const Array<u32>& duplicates, const SolidPlan& solid, Array<u32>& order)
+    {
+        order.clear();
+        Array<u8> placed;
+        placed.resize(files.size());
+        for(u32 i = 0; i < files.size(); ++i) {
+            placed[i] = 0;
+        }
+        FILE* file = nullptr;
+        if(nullptr != param.trace_) {
+#ifdef _MSC_VER
+            fopen_s(&file, param.trace_, "rb");
+#else
+            file = fopen(param.trace_, "rb");
+#endif
+        }
+        TraceHeader header = {};
+        if(nullptr != file && 1 == fread(&header, sizeof(TraceHeader), 1, file) && TraceMagic == header.magic_ && TraceVersion == header.version_) {
+            // Records are matched by path, the trace may come from an older archive with other indices.
+            struct Key
+            {
+                u64 hash_;
+                u32 index_;
+            };
+            Array<Key> keys;
+            for(u32 i = 1; i < files.size(); ++i) {
+                if(static_cast<u8>(Type::File) == files[i].type_) {
+                    std::u8string path = filepath[i].lexically_relative(filepath[0]).generic_u8string();
+                    keys.push_back({path_hash(path.c_str(), path.length()), i});
+                }
+            }
+            if(0 < keys.size()) {
+                std::sort(&keys[0], &keys[0] + keys.size(), [](const Key& x0, const Key& x1) {
+                    return x0.hash_ < x1.hash_;
+                });
+            }
+            static constexpr u32 RecordsPerRead = 256;
+            TraceRecord records[RecordsPerRead];
+            size_t count = 0;
+            while(0 < keys.size() && 0 < (count = fread(records, sizeof(TraceRecord), RecordsPerRead, file))) {
+                for(size_t i = 0; i < count; ++i) {
+                    const Key* key = std::lower_bound(&keys[0], &keys[0] + keys.size(), records[i].path_, [](const Key& x, u64 hash) {
+                        return x.hash_ < hash;
+                    });
+                    if(&keys[0] + keys.size() == key || records[i].path_ != key->hash_) {
+                        continue;
+                    }
+                    // Duplicates are stored with their original, members of a solid block with the whole block.
+                    u32 index = 0 < duplicates[key->index_] ? duplicates[key->index_] : key->index_;
+                    u32 group = solid.group_[index];
+                    index = 0 < group ? solid.members_[solid.start_[group - 1]] : index;
+                    if(0 != placed[index]) {
+                        continue;
+                    }
+                    order.push_back(index);
+                    placed[index] = 1;
+                    if(0 < group) {
+                        for(u32 j = solid.start_[group - 1]; j < solid.start_[group]; ++j) {
+                            placed[solid.members_[j]] = 1;
+                        }
+                    }
+                }
+            }
+        }
+        if(nullptr != file) {
+            fclose(file);
+        }
+        for(u32 i = 0; i < files.size(); ++i) {
+            if(0 == placed[i]) {
+                order.push_back(i);
+            }
+        }
+    }
+
+    /**
+     * Read, compress and write stages joined by a bounded ring of units.
+     * The reader and the writer walk the files in the planned order, so the output does not depend on the number of workers.
+     * Data is hashed while it is written, the archive is never read back.
+     */
+    class Pipeline
+    {
+    public:
+        Pipeline(Array<File>& files, Array<BuildRecord>& records, const Array<std::filesystem::path>& filepath, const Builder::Param& param, Previous* previous, const Array<u8>& dictionary, const Array<u32>& duplicates, const Array<u64>& checksums, const Array<u32>& rules, const SolidPlan& solid, const Array<u32>& order);
+        ~Pipeline();
+
+        bool run(FILE* archive, u64& data_offset, ChunkHash& hash);
+        u64 peak() const;
+        u32 reused() const;
+        u32 rehashed() const;
+
+    private:
+        Pipeline(const Pipeline&) = delete;
+        Pipeline& operator=(const Pipeline&) = delete;
+
+        void read_stage();
+        void compress_stage();
+        bool read_file(u32 index);
+        bool intact(const File& entry);
+        bool copy_file(u32 index, const File& entry);
+        bool read_solid(u32 group);
+        Unit* acquire(u64 sequence, u64 cost);
+        void publish();
+        void fail();
+        bool write(Unit& unit, FILE* archive, u64& data_offset, ChunkHash& hash);
+
+        Array<File>& files_;
+        Array<BuildRecord>& records_;
+        const Array<std::filesystem::path>& filepath_;
+        const Builder::Param& param_;
+        Previous* previous_;
+        const Array<u32>& duplicates_;
+        const Array<u64>& checksums_; //!< checksums taken while looking for duplicates, 0 if unknown
+        const Array<u32>& rules_;
+        const SolidPlan& solid_;
+        const Array<u32>& order_;
+        bool dictionary_;
+        LZ4_streamHC_t* lz4_dictionary_;
+        ZSTD_CDict* zstd_dictionary_;
+        u32 num_threads_;
+        u32 window_;
+        Array<Unit> units_;
+        Array<u64> table_;
+        u64 entry_start_;
+
+        std::mutex mutex_;
+        std::condition_variable condition_;
+        u64 read_;
+        u64 next_;
+        u64 written_;
+        u64 in_flight_; //!< cost of the units between the reader and the writer
+        u64 peak_;      //!< largest in_flight_ so far
+        u32 reused_;
+        u32 rehashed_;
+        bool read_done_;
+        bool abort_;
+    };
+
+    Pipeline::Pipeline(Array<File>& files, Array<BuildRecord>& records, const Array<std::filesystem::path>& filepath, const Builder::Param& param, Previous* previous, const Array<u8>& dictionary, const Array<u32>& duplicates, const Array<u64>& checksums, const Array<u32>& rules, const SolidPlan& solid, const Array<u32>& order)
+        : files_(files)
+        , records_(records)
+        , filepath_(filepath)
+        , param_(param)
+        , previous_(previous)
+        , duplicates_(duplicates)
+        , checksums_(checksums)
+        , rules_(rules)
+        , solid_(solid)
+        , order_(order)
+        , dictionary_(0 < dictionary.size())
+        , lz4_dictionary_(nullptr)
+        , zstd_dictionary_(nullptr)
+        , entry_start_(0)
+        , read_(0)
+        , next_(0)
+        , written_(0)
+        , in_flight_(0)
+        , peak_(0)
+        , reused_(0)
+        , rehashed_(0)
+        , read_done_(false)
+        , abort_(false)
+    {
+        num_threads_ = 0 < param.num_threads_ ? param.num_threads_ : std::thread::hardware_concurrency();
+        num_threads_ = num_threads_ <= 0 ? 1 : num_threads_;
+        window_ = num_threads_ * 2 + 2;
+        units_.resize(window_);
+        // Prepared once, workers only read them.
+        if(dictionary_ && Compression::LZ4 == param.compression_) {
+            lz4_dictionary_ = LZ4_createStreamHC();
+            if(nullptr != lz4_dictionary_) {
+                LZ4_resetStreamHC_fast(lz4_dictionary_, hc_level(param.level_));
+                LZ4_loadDictHC(lz4_dictionary_, (const char*)&dictionary[0], static_cast<int32_t>(dictionary.size()));
+            }
+        } else if(dictionary_ && Compression::Zstd == param.compression_) {
+            zstd_dictionary_ = ZSTD_createCDict(&dictionary[0], dictionary.size(), 0 != param.level_ ? param.level_ : ZSTD_CLEVEL_DEFAULT);
+        }
+    }
+
+    Pipeline::~Pipeline()
+    {
+        LZ4_freeStreamHC(lz4_dictionary_);
+        ZSTD_freeCDict(zstd_dictionary_);
+        for(u32 i = 0; i < units_.size(); ++i) {
+            if(units_[i].encoded_ != units_[i].bytes_) {
+                SFS_FREE(units_[i].encoded_);
+            }
+            SFS_FREE(units_[i].bytes_);
+        }
+    }
+
+    bool Pipeline::run(FILE* archive, u64& data_offset, ChunkHash& hash)
+    {
+        Array<std::thread*> threads;
+        threads.push_back(new std::thread([this]() { read_stage(); }));
+        for(u32 i = 0; i < num_threads_; ++i) {
+            threads.push_back(new std::thread([this]() { compress_stage(); }));
+        }
+        bool result = true;
+        for(u64 sequence = 0;; ++sequence) {
+            Unit& unit = units_[static_cast<u32>(sequence % window_)];
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                condition_.wait(lock, [&]() { return abort_ || unit.ready_ || (read_done_ && read_ <= sequence); });
+                if(abort_) {
+                    result = false;
+                    break;
+                }
+                if(!unit.ready_) {
+                    break;
+                }
+            }
+            result = unit.result_ && write(unit, archive, data_offset, hash);
+            if(unit.encoded_ != unit.bytes_) {
+                SFS_FREE(unit.encoded_);
+            }
+            SFS_FREE(unit.bytes_);
+            unit.encoded_ = nullptr;
+            unit.bytes_ = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                unit.ready_ = false;
+                written_ = sequence + 1;
+                in_flight_ -= unit.cost_;
+                abort_ = abort_ || !result;
+            }
+            condition_.notify_all();
+            if(!result) {
+                break;
+            }
+        }
+        for(u32 i = 0; i < threads.size(); ++i) {
+            threads[i]->join();
+            delete threads[i];
+        }
+        return result;
+    }
+
+    u64 Pipeline::peak() const
+    {
+        return peak_;
+    }
+
+    u32 Pipeline::reused() const
+    {
+        return reused_;
+    }
+
+    u32 Pipeline::rehashed() const
+    {
+        return rehashed_;
+    }
+
+    void Pipeline::read_stage()
+    {
+        for(u32 k = 0; k < order_.size(); ++k) {
+            u32 i = order_[k];
+            // Duplicates take the location of their original once everything is written.
+            if(static_cast<u8>(Type::File) != files_[i].type_ || 0 < duplicates_[i]) {
+                continue;
+            }
+            u32 group = solid_.group_[i];
+            bool result = true;
+            if(0 < group) {
+                // The whole group is read at its first member, the other members are skipped.
+                if(solid_.members_[solid_.start_[group - 1]] == i) {
+                    result = read_solid(group - 1);
+                }
+            } else {
+                result = read_file(i);
+            }
+            if(!result) {
+                fail();
+                return;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            read_done_ = true;
+        }
+        condition_.notify_all();
+    }
+
+    bool Pipeline::read_file(u32 index)
+    {
+        u64 size = files_[index].size_offset_.original_size_;
+        if(nullptr != previous_ && nullptr != previous_->entries_[index]) {
+            const File& entry = *previous_->entries_[index];
+            u64 checksum = checksums_[index];
+            // The same size and write time vouch for the contents, only files written since are hashed.
+            if(0 == checksum && 0 != records_[index].mtime_ && records_[index].mtime_ == previous_->record(entry).mtime_) {
+                checksum = entry.checksum_;
+            }
+            if(0 == checksum) {
+                if(!hash_file(filepath_[index], checksum)) {
+                    return false;
+                }
+                ++rehashed_;
+            }
+            // Bytes of a damaged previous archive are never carried over, the file is compressed again.
+            if(checksum == entry.checksum_ && intact(entry)) {
+                ++reused_;
+                return copy_file(index, entry);
+            }
+        }
+        Builder::Param param = entry_param(param_, rules_, index);
+        bool dictionary = dictionary_ && 0 == rules_[index];
+        UnitType type = classify(size, param, dictionary);
+        u32 block_size = archive_block_size(param);
+        u64 unit_size = size;
+        if(UnitType::Block == type) {
+            unit_size = block_size;
+        } else if(UnitType::Raw == type) {
+            // Stored entries are streamed, only compressed wholes are read at once.
+            u32 chunk_size = 0 < block_size ? block_size : CopyChunkSize;
+            unit_size = chunk_size < size ? chunk_size : size;
+        }
+        FILE* file = nullptr;
+        if(0 < size) {
+#ifdef _MSC_VER
+            fopen_s(&file, (const char*)filepath_[index].u8string().c_str(), "rb");
+#else
+            file = fopen((const char*)filepath_[index].u8string().c_str(), "rb");
+#endif
+            if(nullptr == file) {
+                return false;
+            }
+        }
+        XXH64_state_t* hash_state = XXH64_createState();
+        XXH64_reset(hash_state, HashSeed);
+        u8 compression = entry_compression(size, param, dictionary);
+        u8 rejected = 0;
+        u8 ratio = 0;
+        bool result = true;
+        u64 offset = 0;
+        do {
+            u32 chunk = static_cast<u32>((size - offset) < unit_size ? size - offset : unit_size);
+            Unit* unit = acquire(read_, unit_cost(type, param.compression_, chunk));
+            if(nullptr == unit) {
+                result = false;
+                break;
+            }
+            unit->entry_ = index;
+            unit->size_ = chunk;
+            unit->encoded_size_ = 0;
+            unit->type_ = type;
+            unit->compression_ = compression;
+            unit->rejected_ = rejected;
+            unit->ratio_ = ratio;
+            unit->level_ = param.level_;
+            unit->first_ = 0 == offset;
+            unit->last_ = size <= offset + chunk;
+            unit->result_ = false;
+            unit->encoded_ = nullptr;
+            unit->bytes_ = nullptr;
+            if(0 < chunk) {
+                unit->bytes_ = static_cast<u8*>(SFS_MALLOC(chunk));
+                if(nullptr == unit->bytes_ || fread(unit->bytes_, chunk, 1, file) <= 0) {
+                    result = false;
+                    break;
+                }
+                XXH64_update(hash_state, unit->bytes_, chunk);
+            }
+            // Blocked entries are judged before any worker spends time on them, the rest of the file is streamed raw.
+            if(unit->first_ && UnitType::Block == type && !compressible(unit->bytes_, chunk, param, ratio)) {
+                type = UnitType::Raw;
+                rejected = compression;
+                compression = static_cast<u8>(Compression::Raw);
+                unit->type_ = type;
+                unit->compression_ = compression;
+                unit->rejected_ = rejected;
+                unit->ratio_ = ratio;
+            }
+            unit->checksum_ = unit->last_ ? XXH64_digest(hash_state) : 0;
+            publish();
+            offset += chunk;
+        } while(offset < size);
+        XXH64_freeState(hash_state);
+        if(nullptr != file) {
+            fclose(file);
+        }
+        return result;
+    }
+
+    /**
+     * Whether the chunks which hold the stored bytes of an entry match their hashes, each chunk is read once.
+     */
+    bool Pipeline::intact(const File& entry)
+    {
+        u64 begin = entry.size_offset_.offset_;
+        u64 end = begin + entry.size_offset_.compressed_size_;
+        if(previous_->data_size_ < end) {
+            return false;
+        }
+        for(u64 i = begin / previous_->chunk_size_; i * previous_->chunk_size_ < end; ++i) {
+            ChunkState& state = previous_->checked_[static_cast<u32>(i)];
+            if(ChunkState::Unchecked == state) {
+                u64 position = previous_->chunk_size_ * i;
+                u64 size = (previous_->data_size_ - position) < previous_->chunk_size_ ? previous_->data_size_ - position : previous_->chunk_size_;
+                u8* buffer = static_cast<u8*>(SFS_MALLOC(size));
+                bool result = nullptr != buffer && read_native(previous_->file_, buffer, size, previous_->data_ + position)
+                              && XXH64(buffer, static_cast<size_t>(size), HashSeed) == previous_->chunks_[static_cast<u32>(i)];
+                SFS_FREE(buffer);
+                state = result ? ChunkState::Intact : ChunkState::Damaged;
+            }
+            if(ChunkState::Intact != state) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool Pipeline::copy_file(u32 index, const File& entry)
+    {
+        u64 size = entry.size_offset_.compressed_size_;
+        u64 position = previous_->data_ + entry.size_offset_.offset_;
+        u64 offset = 0;
+        do {
+            u32 chunk = static_cast<u32>((size - offset) < CopyChunkSize ? size - offset : CopyChunkSize);
+            Unit* unit = acquire(read_, unit_cost(UnitType::Copy, param_.compression_, chunk));
+            if(nullptr == unit) {
+                return false;
+            }
+            unit->entry_ = index;
+            unit->size_ = chunk;
+            unit->encoded_size_ = 0;
+            unit->type_ = UnitType::Copy;
+            const BuildRecord& record = previous_->record(entry);
+            unit->compression_ = entry.compression_;
+            unit->rejected_ = record.rejected_;
+            unit->ratio_ = record.ratio_;
+            unit->level_ = record.level_;
+            unit->first_ = 0 == offset;
+            unit->last_ = size <= offset + chunk;
+            unit->result_ = false;
+            unit->checksum_ = entry.checksum_;
+            unit->encoded_ = nullptr;
+            unit->bytes_ = nullptr;
+            if(0 < chunk) {
+                unit->bytes_ = static_cast<u8*>(SFS_MALLOC(chunk));
+                if(nullptr == unit->bytes_ || !read_native(previous_->file_, unit->bytes_, chunk, position + offset)) {
+                    return false;
+                }
+            }
+            publish();
+            offset += chunk;
+        } while(offset < size);
+        return true;
+    }
+
+    bool Pipeline::read_solid(u32 group)
+    {
+        u32 begin = solid_.start_[group];
+        u32 end = solid_.start_[group + 1];
+        u32 size = 0;
+        for(u32 i = begin; i < end; ++i) {
+            size += static_cast<u32>(files_[solid_.members_[i]].size_offset_.original_size_);
+        }
+        Unit* unit = acquire(read_, unit_cost(UnitType::Solid, param_.compression_, size));
+        if(nullptr == unit) {
+            return false;
+        }
+        u32 first = solid_.members_[begin];
+        unit->entry_ = first;
+        unit->size_ = size;
+        unit->encoded_size_ = 0;
+        unit->type_ = UnitType::Solid;
+        unit->compression_ = static_cast<u8>(param_.compression_) | static_cast<u8>(CompressionFlag::Solid);
+        unit->rejected_ = 0;
+        unit->ratio_ = 0;
+        unit->level_ = param_.level_;
+        unit->first_ = true;
+        unit->last_ = true;
+        unit->result_ = false;
+        unit->encoded_ = nullptr;
+        unit->bytes_ = static_cast<u8*>(SFS_MALLOC(size));
+        if(nullptr == unit->bytes_) {
+            return false;
+        }
+        // Checksums and offsets of the members are final here, the writer fills in the location of the block.
+        u32 offset = 0;
+        for(u32 i = begin; i < end; ++i) {
+            File& entry = files_[solid_.members_[i]];
+            u32 member_size = static_cast<u32>(entry.size_offset_.original_size_);
+#ifdef _MSC_VER
+            FILE* file = nullptr;
+            fopen_s(&file, (const char*)filepath_[solid_.members_[i]].u8string().c_str(), "rb");
+#else
+            FILE* file = fopen((const char*)filepath_[solid_.members_[i]].u8string().c_str(), "rb");
+#endif
+            if(nullptr == file) {
+                return false;
+            }
+            bool result = fread(unit->bytes_ + offset, member_size, 1, file) == 1;
+            fclose(file);
+            if(!result) {
+                return false;
+            }
+            entry.checksum_ = XXH64(unit->bytes_ + offset, member_size, HashSeed);
+            entry.block_offset_ = offset;
+            offset += member_size;
+        }
+        unit->checksum_ = files_[first].checksum_;
+        publish();
+        return true;
+    }
+
+    Unit* Pipeline::acquire(u64 sequence, u64 cost)
+    {
+        // A unit larger than the limit still goes alone, units are written in order so the wait always ends.
+        u64 limit = param_.memory_limit_;
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [&]() {
+            return abort_ || (sequence < written_ + window_ && (limit <= 0 || 0 == in_flight_ || in_flight_ + cost <= limit));
+        });
+        if(abort_) {
+            return nullptr;
+        }
+        in_flight_ += cost;
+        peak_ = peak_ < in_flight_ ? in_flight_ : peak_;
+        Unit* unit = &units_[static_cast<u32>(sequence % window_)];
+        unit->cost_ = cost;
+        return unit;
+    }
+
+    void Pipeline::publish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++read_;
+        }
+        condition_.notify_all();
+    }
+
+    void Pipeline::fail()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            abort_ = true;
+        }
+        condition_.notify_all();
+    }
+
+    void Pipeline::compress_stage()
+    {
+        ZSTD_CCtx* zstd = nullptr;
+        LZ4_streamHC_t* lz4 = nullptr;
+        for(;;) {
+            u64 sequence = 0;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                condition_.wait(lock, [&]() { return abort_ || next_ < read_ || read_done_; });
+                if(abort_ || read_ <= next_) {
+                    break;
+                }
+                sequence = next_++;
+            }
+            Unit& unit = units_[static_cast<u32>(sequence % window_)];
+            bool result = true;
+            if(UnitType::Raw == unit.type_ || UnitType::Copy == unit.type_) {
+                unit.encoded_ = unit.bytes_;
+                unit.encoded_size_ = unit.size_;
+            } else if(static_cast<u8>(Compression::Zstd) == (unit.compression_ & CompressionMask)) {
+                size_t size_bound = ZSTD_compressBound(unit.size_);
+                unit.encoded_ = static_cast<u8*>(SFS_MALLOC(size_bound));
+                if(nullptr == zstd) {
+                    zstd = ZSTD_createCCtx();
+                }
+                size_t compressed_size = 0;
+                result = nullptr != unit.encoded_ && nullptr != zstd;
+                if(result && 0 != (unit.compression_ & static_cast<u8>(CompressionFlag::Dictionary))) {
+                    result = nullptr != zstd_dictionary_;
+                    if(result) {
+                        compressed_size = ZSTD_compress_usingCDict(zstd, unit.encoded_, size_bound, unit.bytes_, unit.size_, zstd_dictionary_);
+                    }
+                } else if(result) {
+                    s32 level = 0 != unit.level_ ? unit.level_ : ZSTD_CLEVEL_DEFAULT;
+                    compressed_size = ZSTD_compressCCtx(zstd, unit.encoded_, size_bound, unit.bytes_, unit.size_, level);
+                }
+                result = result && !ZSTD_isError(compressed_size);
+                compressed_size = result ? compressed_size : 0;
+                bool rejected = result && UnitType::Whole == unit.type_ && !meets_ratio(compressed_size, unit.size_, param_);
+                bool raw = rejected || (result && stored_raw(unit, compressed_size));
+                if(raw || (UnitType::Block == unit.type_ && unit.size_ <= compressed_size)) {
+                    SFS_FREE(unit.encoded_);
+                    unit.encoded_ = unit.bytes_;
+                    if(rejected) {
+                        unit.rejected_ = unit.compression_;
+                        unit.ratio_ = percent(compressed_size, unit.size_);
+                    }
+                    if(raw) {
+                        unit.compression_ = static_cast<u8>(Compression::Raw);
+                    }
+                    compressed_size = unit.size_;
+                } else {
+                    SFS_FREE(unit.bytes_);
+                    unit.bytes_ = nullptr;
+                }
+                unit.encoded_size_ = static_cast<u32>(compressed_size);
+            } else {
+                int32_t size_bound = LZ4_compressBound(static_cast<int32_t>(unit.size_));
+                unit.encoded_ = static_cast<u8*>(SFS_MALLOC(size_bound));
+                int32_t compressed_size = 0;
+                s32 level = hc_level(unit.level_);
+                if(nullptr != unit.encoded_ && 0 != (unit.compression_ & static_cast<u8>(CompressionFlag::Dictionary))) {
+                    if(nullptr == lz4) {
+                        lz4 = LZ4_createStreamHC();
+                    }
+                    if(nullptr != lz4 && nullptr != lz4_dictionary_) {
+                        LZ4_resetStreamHC_fast(lz4, level);
+                        LZ4_attach_HC_dictionary(lz4, lz4_dictionary_);
+                        compressed_size = LZ4_compress_HC_continue(lz4, (const char*)unit.bytes_, (char*)unit.encoded_, static_cast<int32_t>(unit.size_), size_bound);
+                    }
+                } else if(nullptr != unit.encoded_ && unit.level_ < 0) {
+                    compressed_size = LZ4_compress_fast((const char*)unit.bytes_, (char*)unit.encoded_, static_cast<int32_t>(unit.size_), size_bound, -unit.level_);
+                } else if(nullptr != unit.encoded_) {
+                    compressed_size = LZ4_compress_HC((const char*)unit.bytes_, (char*)unit.encoded_, static_cast<int32_t>(unit.size_), size_bound, level);
+                }
+                result = 0 < compressed_size;
+                // A block that does not shrink is stored as is, readers tell them apart by the size.
+                // A whole entry which misses the ratio becomes a raw entry, readers do not decode it at all.
+                bool rejected = result && UnitType::Whole == unit.type_ && !meets_ratio(static_cast<u64>(compressed_size), unit.size_, param_);
+                bool raw = rejected || (result && stored_raw(unit, static_cast<u64>(compressed_size)));
+                if(raw || (UnitType::Block == unit.type_ && unit.size_ <= static_cast<u32>(compressed_size))) {
+                    SFS_FREE(unit.encoded_);
+                    unit.encoded_ = unit.bytes_;
+                    if(rejected) {
+                        unit.rejected_ = unit.compression_;
+                        unit.ratio_ = percent(static_cast<u64>(compressed_size), unit.size_);
+                    }
+                    if(raw) {
+                        unit.compression_ = static_cast<u8>(Compression::Raw);
+                    }
+                    compressed_size = static_cast<int32_t>(unit.size_);
+                } else {
+                    SFS_FREE(unit.bytes_);
+                    unit.bytes_ = nullptr;
+                }
+                unit.encoded_size_ = static_cast<u32>(compressed_size);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                unit.result_ = result;
+                unit.ready_ = true;
+            }
+            condition_.notify_all();
+        }
+        ZSTD_freeCCtx(zstd);
+        LZ4_freeStreamHC(lz4);
+    }
+
+    bool Pipeline::write(Unit& unit, FILE* archive, u64& data_offset, ChunkHash& hash)
+    {
+        if(unit.first_) {
+            // Aligned entries do not share a page with their neighbours, the padding is part of the data section.
+            u32 alignment = data_alignment(param_);
+            u64 size = UnitType::Solid == unit.type_ ? unit.size_ : files_[unit.entry_].size_offset_.original_size_;
+            if(0 < alignment && 0 < size && param_.alignment_threshold_ <= size) {
+                u64 padding = (alignment - (data_offset & (alignment - 1))) & (alignment - 1);
+                if(!write_zeros(archive, padding, [&hash](const void* data, u64 length) { hash.update(data, length); })) {
+                    return false;
+                }
+                data_offset += padding;
+            }
+            entry_start_ = data_offset;
+            table_.clear();
+        }
+        if(UnitType::Block == unit.type_) {
+            table_.push_back(data_offset - entry_start_);
+        }
+        if(UnitType::Solid == unit.type_) {
+            if(fwrite(&unit.size_, sizeof(u32), 1, archive) <= 0) {
+                return false;
+            }
+            hash.update(&unit.size_, sizeof(u32));
+            data_offset += sizeof(u32);
+        }
+        if(0 < unit.encoded_size_) {
+            if(fwrite(unit.encoded_, unit.encoded_size_, 1, archive) <= 0) {
+                return false;
+            }
+            hash.update(unit.encoded_, unit.encoded_size_);
+            data_offset += unit.encoded_size_;
+        }
+        if(!unit.last_) {
+            return true;
+        }
+        if(UnitType::Block == unit.type_) {
+            table_.push_back(data_offset - entry_start_);
+            if(fwrite(&table_[0], sizeof(u64) * table_.size(), 1, archive) <= 0) {
+                return false;
+            }
+            hash.update(&table_[0], sizeof(u64) * table_.size());
+            data_offset += sizeof(u64) * table_.size();
+        }
+        if(UnitType::Solid == unit.type_) {
+            u32 group = solid_.group_[unit.entry_] - 1;
+            for(u32 i = solid_.start_[group]; i < solid_.start_[group + 1]; ++i) {
+                File& entry = files_[solid_.members_[i]];
+                entry.compression_ = unit.compression_;
+                records_[solid_.members_[i]].level_ = entry_level(unit.compression_, unit.level_);
+                entry.size_offset_.offset_ = entry_start_;
+                entry.size_offset_.compressed_size_ = data_offset - entry_start_;
+            }
+            return true;
+        }
+        File& entry = files_[unit.entry_];
+        BuildRecord& record = records_[unit.entry_];
+        entry.compression_ = unit.compression_;
+        record.level_ = entry_level(0 != unit.rejected_ ? unit.rejected_ : unit.compression_, unit.level_);
+        record.rejected_ = unit.rejected_;
+        record.ratio_ = unit.ratio_;
+        entry.checksum_ = unit.checksum_;
+        entry.size_offset_.offset_ = entry_start_;
+        entry.size_offset_.compressed_size_ = data_offset - entry_start_;
+        return true;
+    }
+} // namespace
+
+bool Builder::compress(const char* file, const Param& param, PacFS* previous)
+{
+    assert(nullptr != file);
+#ifdef _MSC_VER
+    FILE* f = nullptr;
+    fopen_s(&f, file, "wb");
+#else
+    FILE* f = fopen(file, "wb");
+#endif
+    if(nullptr == f) {
+        return false;
+    }
+    Array<PathSlot> slots;
+    if(param.path_index_) {
+        build_path_index(slots);
+    }
+    Array<u32> duplicates;
+    Array<u64> checksums;
+    find_duplicates(files_, filepath_, param, duplicates, checksums);
+    Array<u32> rules;
+    match_rules(files_, filepath_, param, rules);
+    SolidPlan solid;
+    plan_solid_blocks(files_, param, duplicates, rules, solid);
+    Array<u8> dictionary;
+    train_dictionary(files_, filepath_, param, duplicates, rules, solid, dictionary);
+    Array<u32> order;
+    plan_order(files_, filepath_, param, duplicates, solid, order);
+    Header header = {};
+    header.magic_ = Magic;
+    header.version_ = Version;
+    header.num_entries_ = static_cast<u32>(files_.size());
+    header.name_ = sizeof(Header) + static_cast<u32>(sizeof(File) * files_.size());
+    header.data_ = header.name_ + static_cast<u32>(names_.size());
+    header.flags_ = static_cast<u32>(HeaderFlag::SortedChildren);
+    header.block_size_ = archive_block_size(param);
+    u32 padding = 0;
+    if(0 < slots.size()) {
+        header.index_ = (header.data_ + 0x07UL) & ~0x07UL;
+        header.num_slots_ = slots.size();
+        padding = header.index_ - header.data_;
+        header.data_ = header.index_ + static_cast<u32>(sizeof(PathSlot) * slots.size());
+    }
+    if(0 < dictionary.size()) {
+        header.dictionary_ = header.data_;
+        header.dictionary_size_ = dictionary.size();
+        header.data_ += dictionary.size();
+    }
+    // The data section starts aligned too, entry offsets are relative to it.
+    u32 alignment = data_alignment(param);
+    u32 data_padding = 0;
+    if(0 < alignment) {
+        header.flags_ |= log2(alignment) << AlignmentShift;
+        data_padding = ((header.data_ + alignment - 1) & ~(alignment - 1)) - header.data_;
+        header.data_ += data_padding;
+    }
+    // Reserve the space of the header and the index, both are written once the data is in place.
+    if(0 != SFS_FSEEK(f, static_cast<int64_t>(header.data_), SEEK_SET)) {
+        fclose(f);
+        return false;
+    }
+
+    // Candidates for reuse have the same path, size and layout, the reader compares the write time or else the contents, and checks the stored bytes.
+    // Original packs have no chunk hashes, they cannot be checked and are not reused.
+    Previous reuse;
+    if(nullptr != previous && !previous->load_chunks(reuse.chunks_, reuse.records_)) {
+        previous = nullptr;
+    }
+    if(nullptr != previous) {
+        // Entries compressed with a dictionary are only valid together with that same dictionary.
+        bool same_dictionary = previous->dictionary_size_ == dictionary.size()
+                               && (0 == dictionary.size() || 0 == ::memcmp(previous->dictionary_, &dictionary[0], dictionary.size()));
+        reuse.file_ = previous->file_;
+        reuse.data_ = previous->header_.data_;
+        reuse.data_size_ = previous->header_.chunks_ - previous->header_.data_;
+        reuse.chunk_size_ = previous->header_.chunk_size_;
+        reuse.files_ = previous->files_;
+        reuse.checked_.resize(reuse.chunks_.size());
+        for(u32 i = 0; i < reuse.checked_.size(); ++i) {
+            reuse.checked_[i] = ChunkState::Unchecked;
+        }
+        reuse.entries_.resize(files_.size());
+        for(u32 i = 1; i < files_.size(); ++i) {
+            reuse.entries_[i] = nullptr;
+            if(static_cast<u8>(Type::File) != files_[i].type_ || 0 < duplicates[i] || 0 < solid.group_[i]) {
+                continue;
+            }
+            std::u8string path = filepath_[i].lexically_relative(filepath_[0]).generic_u8string();
+            IFile* old = previous->open_file((const char*)path.c_str());
+            if(nullptr == old) {
+                continue;
+            }
+            const File* entry = static_cast<PacFile*>(old)->file_;
+            const BuildRecord& record = reuse.record(*entry);
+            old->close();
+            u64 size = files_[i].size_offset_.original_size_;
+            Param entry_parameter = entry_param(param, rules, i);
+            u8 compression = entry_compression(size, entry_parameter, 0 < dictionary.size() && 0 == rules[i]);
+            if(0 != (compression & static_cast<u8>(CompressionFlag::Dictionary)) && !same_dictionary) {
+                continue;
+            }
+            // A raw entry whose compression missed the ratio is what this build would store too, as long as the ratio is still missed.
+            bool rejected = static_cast<u8>(Compression::Raw) == entry->compression_ && 0 != record.rejected_ && compression == record.rejected_
+                            && 0 < entry_parameter.maximum_ratio_ && entry_parameter.maximum_ratio_ < record.ratio_;
+            if(static_cast<u8>(Type::File) != entry->type_ || size != entry->size_offset_.original_size_ || (compression != entry->compression_ && !rejected)) {
+                continue;
+            }
+            // Entries are reused only at the level recorded for them, a whole entry has to meet the current ratio too.
+            if(entry_level(compression, entry_parameter.level_) != record.level_) {
+                continue;
+            }
+            bool whole = !rejected && 0 != (compression & CompressionMask) && 0 == (compression & static_cast<u8>(CompressionFlag::Blocked));
+            if(whole && !meets_ratio(entry->size_offset_.compressed_size_, size, entry_parameter)) {
+                continue;
+            }
+            if(0 != (compression & static_cast<u8>(CompressionFlag::Blocked)) && previous->header_.block_size_ != header.block_size_) {
+                continue;
+            }
+            reuse.entries_[i] = entry;
+        }
+    }
+
+    Array<BuildRecord> records;
+    records.resize(files_.size());
+    for(u32 i = 0; i < records.size(); ++i) {
+        records[i].mtime_ = mtimes_[i];
+    }
+    ChunkHash chunk_hash;
+    u64 data_offset = 0;
+    bool result = false;
+    {
+        Pipeline pipeline(files_, records, filepath_, param, nullptr != previous ? &reuse : nullptr, dictionary, duplicates, checksums, rules, solid, order);
+        result = pipeline.run(f, data_offset, chunk_hash);
+        report_.peak_memory_ = pipeline.peak();
+        report_.num_reused_ = pipeline.reused();
+        report_.num_rehashed_ = pipeline.rehashed();
+    }
+    chunk_hash.finish();
+    const Array<u64>& chunks = chunk_hash.hashes();
+    header.chunk_size_ = HashChunkSize;
+    header.chunks_ = header.data_ + data_offset;
+    header.records_ = header.chunks_ + sizeof(u64) * chunks.size();
+    if(result && 0 < chunks.size()) {
+        result = 0 < ::fwrite(&chunks[0], sizeof(u64) * chunks.size(), 1, f);
+    }
+    for(u32 i = 1; result && i < files_.size(); ++i) {
+        if(duplicates[i] <= 0) {
+            continue;
+        }
+        const File& original = files_[duplicates[i]];
+        File& entry = files_[i];
+        entry.size_offset_ = original.size_offset_;
+        entry.checksum_ = original.checksum_;
+        entry.block_offset_ = original.block_offset_;
+        entry.compression_ = original.compression_;
+        records[i].level_ = records[duplicates[i]].level_;
+        records[i].rejected_ = records[duplicates[i]].rejected_;
+        records[i].ratio_ = records[duplicates[i]].ratio_;
+        report_.num_duplicates_ += 1;
+        report_.duplicate_size_ += entry.size_offset_.original_size_;
+        // A member of a solid block shares the block, the block is smaller by about its own size.
+        bool solid_member = 0 != (entry.compression_ & static_cast<u8>(CompressionFlag::Solid));
+        report_.saved_size_ += solid_member ? entry.size_offset_.original_size_ : entry.size_offset_.compressed_size_;
+    }
+    // The records follow the chunk hashes once duplicates have theirs.
+    if(result) {
+        result = 0 < ::fwrite(&records[0], sizeof(BuildRecord) * records.size(), 1, f);
+    }
+    static constexpr u8 zeros[8] = {};
+    if(result) {
+        // The header is covered too, Header::hash_ is still 0 here.
+        XXH64_state_t* hash_state = XXH64_createState();
+        XXH64_reset(hash_state, HashSeed);
+        XXH64_update(hash_state, &header, sizeof(Header));
+        XXH64_update(hash_state, &files_[0], sizeof(File) * files_.size());
+        XXH64_update(hash_state, &names_[0], names_.size());
+        if(0 < slots.size()) {
+            XXH64_update(hash_state, zeros, padding);
+            XXH64_update(hash_state, &slots[0], sizeof(PathSlot) * slots.size());
+        }
+        if(0 < dictionary.size()) {
+            XXH64_update(hash_state, &dictionary[0], dictionary.size());
+        }
+        for(u32 size = data_padding; 0 < size;) {
+            u32 chunk = size < sizeof(Zeros) ? size : static_cast<u32>(sizeof(Zeros));
+            XXH64_update(hash_state, Zeros, chunk);
+            size -= chunk;
+        }
+        u64 metadata = XXH64_digest(hash_state);
+        XXH64_freeState(hash_state);
+        header.hash_ = root_hash(metadata, chunks, records);
+    }
+    if(!result || 0 != SFS_FSEEK(f, 0, SEEK_SET)) {
+        fclose(f);
+        return false;
+    }
+    if(::fwrite(&header, sizeof(Header), 1, f) <= 0) {
+        fclose(f);
+        return false;
+    }
+    if(::fwrite(&files_[0], sizeof(File) * files_.size(), 1, f) <= 0) {
+        fclose(f);
+        return false;
+    }
+    if(::fwrite(&names_[0], names_.size(), 1, f) <= 0) {
+        fclose(f);
+        return false;
+    }
+    if(0 < slots.size()) {
+        if(0 < padding && ::fwrite(zeros, padding, 1, f) <= 0) {
+            fclose(f);
+            return false;
+        }
+        if(::fwrite(&slots[0], sizeof(PathSlot) * slots.size(), 1, f) <= 0) {
+            fclose(f);
+            return false;
+        }
+    }
+    if(0 < dictionary.size()) {
+        if(::fwrite(&dictionary[0], dictionary.size(), 1, f) <= 0) {
+            fclose(f);
+            return false;
+        }
+    }
+    if(!write_zeros(f, data_padding, [](const void*, u64) {})) {
+        fclose(f);
+        return false;
+    }
+    return 0 == fclose(f);
+}
+
+//--- DirectoryIterator
+//-------------------------------------------------------------------
+DirectoryIterator::DirectoryIterator(IFile* parent, IFile* file, u32 index)
+    : parent_(parent)
+    , file_(file)
+    , index_(index)
+{
+    assert(nullptr != parent_);
+}
+
+DirectoryIterator::~DirectoryIterator()
+{
+    parent_ = nullptr;
+    if(nullptr != file_) {
+        file_->close();
+        file_ = nullptr;
+    }
+    index_ = 0;
+}
+
+DirectoryIterator::DirectoryIterator(DirectoryIterator&& other)
+    : parent_(other.parent_)
+    , file_(other.file_)
+    , index_(other.index_)
+{
+    other.parent_ = nullptr;
+    other.file_ = nullptr;
+    other.index_ = 0;
+}
+
+DirectoryIterator& DirectoryIterator::operator=(DirectoryIterator&& other)
+{
     if(this != &other) {
         parent_ = other.parent_;
         file_ = other.file_;
@@ -487,252 +2167,1558 @@ DirectoryIterator& DirectoryIterator::operator=(DirectoryIterator&& other)
         other.file_ = nullptr;
         other.index_ = 0;
     }
-    return *this;
-}
+    return *this;
+}
+
+DirectoryIterator::operator bool() const
+{
+    return nullptr != file_;
+}
+
+IFile& DirectoryIterator::operator*()
+{
+    assert(nullptr != file_);
+    return *file_;
+}
+
+IFile* DirectoryIterator::operator->()
+{
+    assert(nullptr != file_);
+    return file_;
+}
+
+void DirectoryIterator::operator++()
+{
+    assert(nullptr != file_);
+    parent_->next(*this);
+}
+
+//--- SharedBuffer
+//-------------------------------------------------------------------
+SharedBuffer* SharedBuffer::create(u64 size)
+{
+    SharedBuffer* buffer = static_cast<SharedBuffer*>(SFS_MALLOC(sizeof(SharedBuffer) + size));
+    if(nullptr == buffer) {
+        return nullptr;
+    }
+    new(buffer) SharedBuffer();
+    buffer->references_.store(1, std::memory_order_relaxed);
+    buffer->size_ = size;
+    return buffer;
+}
+
+u8* SharedBuffer::data()
+{
+    return reinterpret_cast<u8*>(this + 1);
+}
+
+void SharedBuffer::add_reference()
+{
+    references_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedBuffer::release()
+{
+    if(1 == references_.fetch_sub(1, std::memory_order_acq_rel)) {
+        this->~SharedBuffer();
+        SFS_FREE(this);
+    }
+}
+
+//--- FileView
+//-------------------------------------------------------------------
+FileView::FileView()
+    : data_(nullptr)
+    , size_(0)
+    , buffer_(nullptr)
+{
+}
+
+FileView::FileView(const void* data, u64 size, SharedBuffer* buffer)
+    : data_(data)
+    , size_(size)
+    , buffer_(buffer)
+{
+}
+
+FileView::~FileView()
+{
+    reset();
+}
+
+FileView::FileView(FileView&& other)
+    : data_(other.data_)
+    , size_(other.size_)
+    , buffer_(other.buffer_)
+{
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.buffer_ = nullptr;
+}
+
+FileView& FileView::operator=(FileView&& other)
+{
+    if(this != &other) {
+        reset();
+        data_ = other.data_;
+        size_ = other.size_;
+        buffer_ = other.buffer_;
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.buffer_ = nullptr;
+    }
+    return *this;
+}
+
+FileView::operator bool() const
+{
+    return nullptr != data_;
+}
+
+const void* FileView::data() const
+{
+    return data_;
+}
+
+u64 FileView::size() const
+{
+    return size_;
+}
+
+void FileView::reset()
+{
+    if(nullptr != buffer_) {
+        buffer_->release();
+    }
+    buffer_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+}
+
+namespace
+{
+    size_t name_length(const char* begin, const char* end)
+    {
+        const char* c = begin;
+        while(c < end) {
+            if('/' == c[0] || '\0' == c[0]) {
+                break;
+            }
+            ++c;
+        }
+        return static_cast<size_t>(std::distance(begin, c));
+    }
+
+    bool equals(const std::filesystem::directory_entry& entry, size_t len, const char* filename)
+    {
+        std::u8string name = entry.path().filename().u8string();
+        if(len != name.length()) {
+            return false;
+        }
+        for(size_t i = 0; i < len; ++i) {
+            if(name[i] != filename[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool equals(size_t len0, const char* x0, size_t len1, const char* x1)
+    {
+        if(len0 != len1){
+            return false;
+        }
+        for(size_t i = 0; i < len0; ++i) {
+            if(x0[i] != x1[i]){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    s32 compare(size_t len0, const char* x0, size_t len1, const char* x1)
+    {
+        s32 r = ::memcmp(x0, x1, len0 < len1 ? len0 : len1);
+        if(0 != r) {
+            return r;
+        }
+        return len0 < len1 ? -1 : (len1 < len0 ? 1 : 0);
+    }
+} // namespace
+
+//--- PhyFile
+//-------------------------------------------------------------------
+PhyFile::PhyFile()
+    : fs_(nullptr)
+    , is_file_(false)
+    , size_(0)
+{
+}
+
+PhyFile::~PhyFile()
+{
+    is_file_ = false;
+    size_ = 0;
+}
+
+void PhyFile::close()
+{
+    if(nullptr != fs_) {
+        fs_->close_file(this);
+        fs_ = nullptr;
+    }
+}
+
+u64 PhyFile::original_size() const
+{
+    return size_;
+}
+
+u64 PhyFile::compressed_size() const
+{
+    return size_;
+}
+
+bool PhyFile::is_file() const
+{
+    return is_file_;
+}
+
+u32 PhyFile::num_children() const
+{
+    return children_.size();
+}
+
+DirectoryIterator PhyFile::begin()
+{
+    using namespace std::filesystem;
+    if(children_.size()<=0){
+        return DirectoryIterator(this, nullptr, 0);
+    }
+    PhyFile* file = fs_->pop();
+    file->initialize(fs_, children_[0]);
+    return DirectoryIterator(this, file, 0);
+}
+
+void PhyFile::next(DirectoryIterator& itr)
+{
+    using namespace std::filesystem;
+    assert(nullptr != itr.parent_);
+    if(nullptr == itr.file_) {
+        return;
+    }
+    itr.file_->close();
+    itr.file_ = nullptr;
+    u32 next = itr.index_ + 1;
+    if(children_.size()<=next){
+        return;
+    }
+    PhyFile* file = fs_->pop();
+    file->initialize(fs_, children_[next]);
+    itr.file_ = file;
+    itr.index_ = next;
+}
+
+std::u8string_view PhyFile::filename() const
+{
+    return filename_;
+}
+
+u32 PhyFile::read(void* dst)
+{
+    assert(nullptr != fs_);
+
+    #ifdef _MSC_VER
+    FILE* file = nullptr;
+    fopen_s(&file, (const char*)filepath_.c_str(), "rb");
+    #else
+    FILE* file = fopen((const char*)filepath_.c_str(), "rb");
+    #endif
+    if(nullptr == file){
+        return 0;
+    }
+    size_t r = fread(dst, size_, 1, file);
+    fclose(file);
+    return r;
+}
+
+u64 PhyFile::read(void* dst, u64 offset, u64 size)
+{
+    assert(nullptr != fs_);
+    if(!is_file_ || size_ <= offset) {
+        return 0;
+    }
+    size = (size_ - offset) < size ? size_ - offset : size;
+    std::intptr_t file = open_native(std::filesystem::path(filepath_));
+    if(InvalidHandle == file) {
+        return 0;
+    }
+    bool result = read_native(file, dst, size, offset);
+    close_native(file);
+    return result ? size : 0;
+}
+
+FileView PhyFile::view()
+{
+    assert(nullptr != fs_);
+    if(!is_file_) {
+        return FileView();
+    }
+    SharedBuffer* buffer = SharedBuffer::create(size_);
+    if(nullptr == buffer) {
+        return FileView();
+    }
+    if(0 < size_ && read(buffer->data()) <= 0) {
+        buffer->release();
+        return FileView();
+    }
+    return FileView(buffer->data(), size_, buffer);
+}
+
+void PhyFile::initialize(PhyFS* fs, const std::filesystem::directory_entry& entry)
+{
+    assert(nullptr != fs);
+    assert(!is_hidden(entry));
+    using namespace std::filesystem;
+    fs_ = fs;
+    is_file_ = entry.is_regular_file();
+    size_ = is_file_ ? entry.file_size() : 0;
+    filepath_ = entry.path().u8string();
+    filename_ = entry.path().filename().u8string();
+    if(!is_file_) {
+        for(const directory_entry& x: directory_iterator(entry)) {
+            if(is_hidden(x)) {
+                continue;
+            }
+            if(x.is_regular_file() || x.is_directory()) {
+                children_.push_back(x);
+            }
+        }
+    }
+}
+
+//--- PhyFS
+//-------------------------------------------------------------------
+PhyFS::PhyFS()
+    : opend_(0)
+    , pages_(nullptr)
+    , entries_(nullptr)
+{
+}
+
+PhyFS::~PhyFS()
+{
+    while(nullptr != pages_) {
+        Page* next = pages_->next_;
+        SFS_FREE(pages_);
+        pages_ = next;
+    }
+    entries_ = nullptr;
+}
+
+bool PhyFS::open(const char* filepath)
+{
+    assert(nullptr != filepath);
+    std::filesystem::path path(filepath);
+    if(!std::filesystem::exists(path)) {
+        return false;
+    }
+    if(!std::filesystem::is_directory(path)) {
+        return false;
+    }
+    std::error_code error;
+    root_ = std::filesystem::directory_entry(path, error);
+    return error ? false : true;
+}
+
+void PhyFS::close()
+{
+}
+
+IFile* PhyFS::open_file(const char* filepath)
+{
+    assert(nullptr != filepath);
+    const char* begin = '/' == filepath[0] ? filepath + 1 : filepath;
+    size_t len = strnlen(begin, MaxPath);
+    if(len<=0){
+        PhyFile* file = pop();
+        file->initialize(this, root_);
+        return file;
+    }
+    return open_file(root_, begin, begin + len);
+}
+
+bool PhyFS::close_file(IFile* file)
+{
+    assert(nullptr != file);
+    std::uintptr_t p = (std::uintptr_t)file;
+    Page* page = pages_;
+    while(nullptr != page) {
+        if((std::uintptr_t)page < p && p < ((std::uintptr_t)page + PageSize)) {
+            Entry* f = (Entry*)file;
+            f->file_.~PhyFile();
+            push(f);
+            return true;
+        }
+        page = page->next_;
+    }
+    return false;
+}
+
+IFile* PhyFS::open_file(const std::filesystem::directory_entry& root, const char* begin, const char* end)
+{
+    using namespace std::filesystem;
+    size_t len = name_length(begin, end);
+    const char* next = '/' == begin[len] ? begin + len + 1 : begin + len;
+    for(const directory_entry& x: directory_iterator(root)) {
+        if(is_hidden(x)) {
+            continue;
+        }
+        if(equals(x, len, begin)) {
+            if('\0' == next[0]) {
+                PhyFile* file = pop();
+                file->initialize(this, x);
+                return file;
+            }
+            return open_file(x, next, end);
+        }
+    }
+    return nullptr;
+}
+
+PhyFile* PhyFS::pop()
+{
+    if(nullptr == entries_) {
+        alloc_page();
+        assert(nullptr != entries_);
+    }
+    Entry* entry = entries_;
+    entries_ = entries_->next_;
+    ++opend_;
+    return new(&entry->file_) PhyFile();
+}
+
+void PhyFS::push(Entry* f)
+{
+    --opend_;
+    f->next_ = entries_;
+    entries_ = f;
+}
+
+void PhyFS::alloc_page()
+{
+    Page* page = (Page*)SFS_MALLOC(PageSize);
+    Entry* entries = reinterpret_cast<Entry*>(&page[1]);
+    u32 num_entries = (PageSize - sizeof(Page)) / sizeof(Entry);
+    assert(num_entries * sizeof(Entry) <= (PageSize - sizeof(Page)));
+    for(u32 i = 1; i < num_entries; ++i) {
+        entries[i - 1].next_ = &entries[i];
+    }
+    entries[num_entries - 1].next_ = entries_;
+    entries_ = entries;
+    page->next_ = pages_;
+    pages_ = page;
+}
+
+namespace
+{
+    inline constexpr u32 DirectAlignment = 4096; //!< offsets, sizes and buffers of direct reads are multiples of this
+    inline constexpr u32 DirectChunkSize = 1024 * 1024; //!< capacity of a bounce buffer
+    inline constexpr u32 NumScratchBuffers = 4; //!< one per PacFS::Buffer
+    inline constexpr u32 ScratchLimit = 16 * 1024 * 1024; //!< larger scratch buffers are freed once their read is done
+
+    /**
+     * Open for reads which bypass the page cache, InvalidHandle where the platform or the file system has no such mode.
+     */
+    std::intptr_t open_direct(const std::filesystem::path& path)
+    {
+#ifdef _MSC_VER
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING, nullptr);
+        return INVALID_HANDLE_VALUE == file ? InvalidHandle : reinterpret_cast<std::intptr_t>(file);
+#elif defined(O_DIRECT)
+        int fd = ::open((const char*)path.u8string().c_str(), O_RDONLY | O_DIRECT);
+        return fd < 0 ? InvalidHandle : static_cast<std::intptr_t>(fd);
+#elif defined(F_NOCACHE)
+        int fd = ::open((const char*)path.u8string().c_str(), O_RDONLY);
+        if(0 <= fd && fcntl(fd, F_NOCACHE, 1) < 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        return fd < 0 ? InvalidHandle : static_cast<std::intptr_t>(fd);
+#else
+        (void)path;
+        return InvalidHandle;
+#endif
+    }
+
+    inline constexpr u64 ReadaheadLimit = 64 * 1024 * 1024; //!< bytes hinted for the files of one directory
+    inline constexpr u64 AdviceGap = 64 * 1024; //!< ranges closer than this are hinted together
+
+    /**
+     * Pass an access pattern for a range of the file to the kernel, a size of 0 extends to the end of the file.
+     * Platforms without such hints ignore them.
+     */
+    void advise_native(std::intptr_t handle, u64 offset, u64 size, PacFS::Advice advice)
+    {
+#if defined(POSIX_FADV_NORMAL)
+        static constexpr int advices[] = {POSIX_FADV_NORMAL, POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED};
+        posix_fadvise(static_cast<int>(handle), static_cast<off_t>(offset), static_cast<off_t>(size), advices[static_cast<u32>(advice)]);
+#elif defined(F_RDADVISE)
+        if(PacFS::Advice::WillNeed == advice) {
+            struct radvisory ra;
+            ra.ra_offset = static_cast<off_t>(offset);
+            ra.ra_count = static_cast<int>(0x7FFF'FFFFULL < size || 0 == size ? 0x7FFF'FFFFULL : size);
+            fcntl(static_cast<int>(handle), F_RDADVISE, &ra);
+        } else if(PacFS::Advice::Random == advice || PacFS::Advice::Sequential == advice) {
+            fcntl(static_cast<int>(handle), F_RDAHEAD, PacFS::Advice::Random == advice ? 0 : 1);
+        }
+#else
+        (void)handle;
+        (void)offset;
+        (void)size;
+        (void)advice;
+#endif
+    }
 
-DirectoryIterator::operator bool() const
-{
-    return nullptr != file_;
-}
+    /**
+     * Pass an access pattern for a range of the mapping to the kernel, the range is widened to whole pages.
+     */
+    void advise_map(const u8* map, u64 map_size, u64 offset, u64 size, PacFS::Advice advice)
+    {
+        if(map_size <= offset) {
+            return;
+        }
+        u64 end = 0 == size || map_size - offset < size ? map_size : offset + size;
+#ifdef _MSC_VER
+#    if defined(_WIN32_WINNT) && 0x0602 <= _WIN32_WINNT
+        if(PacFS::Advice::WillNeed == advice) {
+            WIN32_MEMORY_RANGE_ENTRY range = {const_cast<u8*>(map + offset), static_cast<SIZE_T>(end - offset)};
+            PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+        }
+#    else
+        (void)map;
+        (void)end;
+        (void)advice;
+#    endif
+#else
+        static constexpr int advices[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+        u64 page = static_cast<u64>(sysconf(_SC_PAGESIZE));
+        u64 begin = offset & ~(page - 1);
+        madvise(const_cast<u8*>(map + begin), static_cast<size_t>(end - begin), advices[static_cast<u32>(advice)]);
+#endif
+    }
 
-IFile& DirectoryIterator::operator*()
-{
-    assert(nullptr != file_);
-    return *file_;
-}
+    const u8* map_file(const std::filesystem::path& path, u64& size)
+    {
+        size = 0;
+#ifdef _MSC_VER
+        HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(INVALID_HANDLE_VALUE == file) {
+            return nullptr;
+        }
+        LARGE_INTEGER file_size;
+        if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart <= 0) {
+            CloseHandle(file);
+            return nullptr;
+        }
+        HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if(nullptr == mapping) {
+            return nullptr;
+        }
+        void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if(nullptr == ptr) {
+            return nullptr;
+        }
+        size = static_cast<u64>(file_size.QuadPart);
+        return static_cast<const u8*>(ptr);
+#else
+        int fd = ::open((const char*)path.u8string().c_str(), O_RDONLY);
+        if(fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if(fstat(fd, &st) < 0 || st.st_size <= 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        void* ptr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(MAP_FAILED == ptr) {
+            return nullptr;
+        }
+        size = static_cast<u64>(st.st_size);
+        return static_cast<const u8*>(ptr);
+#endif
+    }
 
-IFile* DirectoryIterator::operator->()
-{
-    assert(nullptr != file_);
-    return file_;
-}
+    inline constexpr u32 OriginalMagic = 0x70616330UL; //!< packs written before the header had a version
+    inline constexpr u32 OriginalVersion = 0; //!< version given to packs with OriginalMagic
 
-void DirectoryIterator::operator++()
-{
-    assert(nullptr != file_);
-    parent_->next(*this);
-}
+    /**
+     * Header of packs with OriginalMagic.
+     */
+    struct OriginalHeader
+    {
+        u32 magic_;
+        u32 num_entries_;
+        u32 name_;
+        u32 data_;
+        u64 hash_; //!< XXH64 of everything after the header, taken while the entries of files still had no location
+    };
 
-namespace
-{
-    size_t name_length(const char* begin, const char* end)
+    /**
+     * Entry of packs with OriginalMagic, 32 bit sizes and no checksum.
+     */
+    struct OriginalFile
     {
-        const char* c = begin;
-        while(c < end) {
-            if('/' == c[0] || '\0' == c[0]) {
-                break;
+        struct OriginalSizeOffset
+        {
+            u64 offset_;
+            u32 original_size_;
+            u32 compressed_size_;
+        };
+        union
+        {
+            OriginalSizeOffset size_offset_;
+            Children children_;
+        };
+        u32 name_offset_;
+        u16 name_length_;
+        u8 type_;
+        u8 compression_;
+    };
+
+    u32 header_size(u32 version)
+    {
+        return OriginalVersion == version ? static_cast<u32>(sizeof(OriginalHeader)) : static_cast<u32>(sizeof(Header));
+    }
+
+    /**
+     * Hash the full path of every entry below a directory, the same keys as the path hash table.
+     */
+    void hash_paths(const File* files, const char* names, u32 num_entries, u32 directory, std::string& path, Array<u64>& hashes)
+    {
+        u64 start = files[directory].children_.child_start_;
+        u64 count = files[directory].children_.num_children_;
+        if(num_entries < start || num_entries - start < count) {
+            return;
+        }
+        size_t length = path.length();
+        for(u32 i = static_cast<u32>(start); i < start + count; ++i) {
+            const File& child = files[i];
+            if(0 < length) {
+                path.push_back('/');
             }
-            ++c;
+            path.append(&names[child.name_offset_], child.name_length_);
+            hashes[i] = path_hash(path.data(), path.length());
+            // Children follow their parent, which also stops cycles of a broken index.
+            if(static_cast<u8>(Type::Directory) == child.type_ && directory < i) {
+                hash_paths(files, names, num_entries, i, path, hashes);
+            }
+            path.resize(length);
         }
-        return static_cast<size_t>(std::distance(begin, c));
     }
 
-    bool equals(const std::filesystem::directory_entry& entry, size_t len, const char* filename)
+    u64 steady_nanoseconds()
     {
-        std::u8string name = entry.path().filename().u8string();
-        if(len != name.length()) {
+        return static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    u64 entry_size(u32 version)
+    {
+        return OriginalVersion == version ? sizeof(OriginalFile) : sizeof(File);
+    }
+
+    /**
+     * Widen the entries of an original pack to File.
+     */
+    File* widen_entries(const u8* src, u32 num_entries)
+    {
+        File* files = (File*)SFS_MALLOC(sizeof(File) * num_entries);
+        if(nullptr == files) {
+            return nullptr;
+        }
+        for(u32 i = 0; i < num_entries; ++i) {
+            OriginalFile original;
+            ::memcpy(&original, src + sizeof(OriginalFile) * i, sizeof(OriginalFile));
+            File& file = files[i];
+            ::memset(&file, 0, sizeof(File));
+            if(static_cast<u8>(Type::Directory) == original.type_) {
+                file.children_ = original.children_;
+            } else {
+                file.size_offset_.offset_ = original.size_offset_.offset_;
+                file.size_offset_.original_size_ = original.size_offset_.original_size_;
+                file.size_offset_.compressed_size_ = original.size_offset_.compressed_size_;
+            }
+            file.name_offset_ = original.name_offset_;
+            file.name_length_ = original.name_length_;
+            file.type_ = original.type_;
+            file.compression_ = original.compression_;
+        }
+        return files;
+    }
+
+    bool check_header(const Header& header)
+    {
+        if(Magic != header.magic_ || (OriginalVersion != header.version_ && Version != header.version_)) {
             return false;
         }
-        for(size_t i = 0; i < len; ++i) {
-            if(name[i] != filename[i]) {
+        // Every versioned pack has chunk hashes, only the original format goes without them.
+        if(OriginalVersion != header.version_ && (header.chunk_size_ <= 0 || header.chunks_ < header.data_ || header.records_ < header.chunks_)) {
+            return false;
+        }
+        if(header.name_ < header_size(header.version_) + entry_size(header.version_) * static_cast<u64>(header.num_entries_) || header.num_entries_ <= 0) {
+            return false;
+        }
+        if(0 < header.num_slots_) {
+            if((header.num_slots_ & (header.num_slots_ - 1)) != 0 || header.index_ < header.name_ || (header.index_ & 0x07UL) != 0) {
+                return false;
+            }
+            if(header.data_ < header.index_ + sizeof(PathSlot) * static_cast<u64>(header.num_slots_)) {
                 return false;
             }
         }
-        return true;
+        if(0 < header.dictionary_size_) {
+            if(header.dictionary_ < header.name_ || header.data_ < static_cast<u64>(header.dictionary_) + header.dictionary_size_) {
+                return false;
+            }
+        }
+        return header.name_ <= header.data_;
     }
 
-    bool equals(size_t len0, const char* x0, size_t len1, const char* x1)
+    /**
+     * Blocks of a blocked entry which are loaded together, bounds the scratch memory of large reads.
+     */
+    inline constexpr u64 MaxBlocksPerLoad = 256;
+
+    /**
+     * Read the header at the start of a pack of size bytes, the original header is converted to an unsorted pack of OriginalVersion.
+     */
+    bool parse_header(const u8* src, u64 size, Header& header)
     {
-        if(len0 != len1){
+        u32 magic = 0;
+        if(size < sizeof(magic)) {
             return false;
         }
-        for(size_t i = 0; i < len0; ++i) {
-            if(x0[i] != x1[i]){
+        ::memcpy(&magic, src, sizeof(magic));
+        if(OriginalMagic == magic) {
+            OriginalHeader original;
+            if(size < sizeof(OriginalHeader)) {
                 return false;
             }
+            ::memcpy(&original, src, sizeof(OriginalHeader));
+            header = {};
+            header.magic_ = Magic;
+            header.version_ = OriginalVersion;
+            header.num_entries_ = original.num_entries_;
+            header.name_ = original.name_;
+            header.data_ = original.data_;
+            header.hash_ = original.hash_;
+            return check_header(header);
         }
-        return true;
+        if(size < sizeof(Header)) {
+            return false;
+        }
+        ::memcpy(&header, src, sizeof(Header));
+        // OriginalVersion is only given to the original header above.
+        return Version == header.version_ && check_header(header);
+    }
+
+    /**
+     * Feed the entries of an original pack to a hash as they were when it was taken, files had no location nor compression yet.
+     */
+    void hash_original_entries(XXH64_state_t* hash_state, const u8* src, u32 num_entries)
+    {
+        for(u32 i = 0; i < num_entries; ++i) {
+            OriginalFile original;
+            ::memcpy(&original, src + sizeof(OriginalFile) * i, sizeof(OriginalFile));
+            if(static_cast<u8>(Type::File) == original.type_) {
+                original.size_offset_.offset_ = 0;
+                original.size_offset_.compressed_size_ = 0;
+                original.compression_ = 0;
+            }
+            XXH64_update(hash_state, &original, sizeof(OriginalFile));
+        }
+    }
+
+    u64 load_u64(const u8* src)
+    {
+        u64 x;
+        ::memcpy(&x, src, sizeof(u64));
+        return x;
+    }
+
+    /**
+     * Decompression context of the calling thread, reads on a shared PacFS run concurrently.
+     */
+    struct ZstdContext
+    {
+        ZstdContext()
+            : context_(ZSTD_createDCtx())
+        {
+        }
+
+        ~ZstdContext()
+        {
+            ZSTD_freeDCtx(context_);
+        }
+
+        ZSTD_DCtx* context_;
+    };
+
+    ZSTD_DCtx* zstd_context()
+    {
+        thread_local ZstdContext context;
+        return context.context_;
+    }
+
+    /**
+     * Decode the first dst_size bytes of a compressed stream of original_size bytes.
+     */
+    bool decode(u8 compression, const u8* src, u32 src_size, u8* dst, u32 dst_size, u32 original_size)
+    {
+        switch(static_cast<Compression>(compression & CompressionMask)) {
+        case Compression::LZ4: {
+            int32_t r = dst_size < original_size
+                            ? LZ4_decompress_safe_partial((const char*)src, (char*)dst, static_cast<int32_t>(src_size), static_cast<int32_t>(dst_size), static_cast<int32_t>(dst_size))
+                            : LZ4_decompress_safe((const char*)src, (char*)dst, static_cast<int32_t>(src_size), static_cast<int32_t>(dst_size));
+            return static_cast<int32_t>(dst_size) <= r;
+        }
+        case Compression::Zstd: {
+            ZSTD_DCtx* context = zstd_context();
+            if(nullptr == context) {
+                return false;
+            }
+            if(original_size <= dst_size) {
+                size_t r = ZSTD_decompressDCtx(context, dst, dst_size, src, src_size);
+                return !ZSTD_isError(r) && dst_size == r;
+            }
+            // Streaming stops as soon as the output is full, like LZ4_decompress_safe_partial.
+            ZSTD_DCtx_reset(context, ZSTD_reset_session_only);
+            ZSTD_inBuffer input = {src, src_size, 0};
+            ZSTD_outBuffer output = {dst, dst_size, 0};
+            while(output.pos < output.size) {
+                size_t pos = output.pos;
+                size_t r = ZSTD_decompressStream(context, &output, &input);
+                if(ZSTD_isError(r) || 0 == r || (input.pos == input.size && pos == output.pos)) {
+                    break;
+                }
+            }
+            return output.pos == output.size;
+        }
+        default:
+            return false;
+        }
+    }
+
+    bool decode_dictionary(u8 compression, const u8* src, u32 src_size, u8* dst, u32 dst_size, const u8* dictionary, u32 dictionary_size, const ZSTD_DDict* zstd_dictionary)
+    {
+        if(dictionary_size <= 0) {
+            return false;
+        }
+        switch(static_cast<Compression>(compression & CompressionMask)) {
+        case Compression::LZ4: {
+            int32_t r = LZ4_decompress_safe_usingDict((const char*)src, (char*)dst, static_cast<int32_t>(src_size), static_cast<int32_t>(dst_size), (const char*)dictionary, static_cast<int32_t>(dictionary_size));
+            return static_cast<int32_t>(dst_size) == r;
+        }
+        case Compression::Zstd: {
+            ZSTD_DCtx* context = zstd_context();
+            if(nullptr == context || nullptr == zstd_dictionary) {
+                return false;
+            }
+            size_t r = ZSTD_decompress_usingDDict(context, dst, dst_size, src, src_size, zstd_dictionary);
+            return !ZSTD_isError(r) && dst_size == r;
+        }
+        default:
+            return false;
+        }
+    }
+
+    bool decode_block(u8 compression, const u8* src, u32 src_size, u8* dst, u32 dst_size)
+    {
+        if(src_size == dst_size) {
+            ::memcpy(dst, src, dst_size);
+            return true;
+        }
+        return decode(compression, src, src_size, dst, dst_size, dst_size);
+    }
+
+    void unmap_file(const u8* ptr, u64 size)
+    {
+        if(nullptr == ptr) {
+            return;
+        }
+#ifdef _MSC_VER
+        (void)size;
+        UnmapViewOfFile(ptr);
+#else
+        munmap(const_cast<u8*>(ptr), static_cast<size_t>(size));
+#endif
     }
 } // namespace
 
-//--- PhyFile
+//--- Scratch
 //-------------------------------------------------------------------
-PhyFile::PhyFile()
+/**
+ * Scratch buffers of one read, a PacFS keeps the free ones for the next reads.
+ */
+struct Scratch
+{
+    Scratch* next_;
+    BufferPool buffers_[NumScratchBuffers];
+};
+
+//--- PacFile
+//-------------------------------------------------------------------
+PacFile::PacFile()
     : fs_(nullptr)
-    , is_file_(false)
-    , size_(0)
+    , file_(nullptr)
 {
 }
 
-PhyFile::~PhyFile()
+PacFile::~PacFile()
 {
-    is_file_ = false;
-    size_ = 0;
+    fs_ = nullptr;
+    file_ = nullptr;
 }
 
-void PhyFile::close()
+void PacFile::close()
 {
-    if(nullptr != fs_) {
-        fs_->close_file(this);
-        fs_ = nullptr;
+    // The entry goes back to the pool inside close_file and may be reused by another thread right away.
+    PacFS* fs = fs_;
+    fs_ = nullptr;
+    file_ = nullptr;
+    if(nullptr != fs) {
+        fs->close_file(this);
+    }
+}
+
+u64 PacFile::original_size() const
+{
+    return file_->type_==(u8)Type::File? file_->size_offset_.original_size_ : 0;
+}
+
+u64 PacFile::compressed_size() const
+{
+    return file_->type_==(u8)Type::File? file_->size_offset_.compressed_size_ : 0;
+}
+
+bool PacFile::is_file() const
+{
+    return file_->type_==(u8)Type::File;
+}
+
+u32 PacFile::num_children() const
+{
+    return file_->type_==(u8)Type::Directory? file_->children_.num_children_ : 0;
+}
+
+DirectoryIterator PacFile::begin()
+{
+    if(file_->type_ != (u8)Type::Directory || file_->children_.num_children_<=0){
+        return DirectoryIterator(this, nullptr, 0);
+    }
+    if(fs_->hints_) {
+        fs_->advise(this, PacFS::Advice::WillNeed);
+    }
+    PacFile* file = fs_->pop();
+    const File& child = fs_->files_[file_->children_.child_start_];
+    file->initialize(fs_, &child);
+    return DirectoryIterator(this, file, 0);
+}
+
+void PacFile::next(DirectoryIterator& itr)
+{
+    assert(nullptr != itr.parent_);
+    if(nullptr == itr.file_) {
+        return;
+    }
+    itr.file_->close();
+    itr.file_ = nullptr;
+    u32 next = itr.index_ + 1;
+    if(file_->children_.num_children_<=next){
+        return;
+    }
+    PacFile* file = fs_->pop();
+    const File& child = fs_->files_[file_->children_.child_start_+next];
+    file->initialize(fs_, &child);
+    itr.file_ = file;
+    itr.index_ = next;
+}
+
+std::u8string_view PacFile::filename() const
+{
+    return std::u8string_view((const char8_t*)&fs_->names_[file_->name_offset_], file_->name_length_);
+}
+
+u32 PacFile::read(void* dst)
+{
+    assert(nullptr != fs_);
+    assert(nullptr != file_);
+    assert(is_file());
+    Scratch* scratch = fs_->lease_scratch();
+    if(nullptr == scratch) {
+        return 0;
+    }
+    u32 result = read(dst, *scratch);
+    fs_->release_scratch(scratch);
+    return result;
+}
+
+u32 PacFile::read(void* dst, Scratch& scratch)
+{
+    if(fs_->tracing_) {
+        fs_->record(*file_, TraceEvent::Read);
+    }
+    if(nullptr != fs_->cache_) {
+        SharedBuffer* buffer = fs_->acquire_cached(*this, scratch);
+        if(nullptr != buffer) {
+            ::memcpy(dst, buffer->data(), buffer->size_);
+            buffer->release();
+            return 1;
+        }
+    }
+    return read_entry(dst, scratch);
+}
+
+u64 PacFile::read(void* dst, u64 offset, u64 size)
+{
+    assert(nullptr != fs_);
+    assert(nullptr != file_);
+    if(!is_file()) {
+        return 0;
+    }
+    Scratch* scratch = fs_->lease_scratch();
+    if(nullptr == scratch) {
+        return 0;
+    }
+    u64 result = read(dst, offset, size, *scratch);
+    fs_->release_scratch(scratch);
+    return result;
+}
+
+u64 PacFile::read(void* dst, u64 offset, u64 size, Scratch& scratch)
+{
+    u64 original_size = file_->size_offset_.original_size_;
+    if(original_size <= offset || size <= 0) {
+        return 0;
+    }
+    size = (original_size - offset) < size ? original_size - offset : size;
+    if(fs_->tracing_) {
+        fs_->record(*file_, TraceEvent::Read);
+    }
+    if(nullptr != fs_->cache_) {
+        SharedBuffer* buffer = fs_->acquire_cached(*this, scratch);
+        if(nullptr != buffer) {
+            ::memcpy(dst, buffer->data() + offset, size);
+            buffer->release();
+            return size;
+        }
     }
+    return read_entry(dst, offset, size, scratch);
 }
 
-u32 PhyFile::original_size() const
+u32 PacFile::read_entry(void* dst, Scratch& scratch)
 {
-    return size_;
-}
+    u64 original_size = file_->size_offset_.original_size_;
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Solid))) {
+        return original_size == read_solid(dst, 0, original_size, scratch) && verify(dst) ? 1 : 0;
+    }
+    u64 compressed_size = file_->size_offset_.compressed_size_;
+    u64 position = file_->size_offset_.offset_ + fs_->header_.data_;
 
-u32 PhyFile::compressed_size() const
-{
-    return size_;
+    if((u8)Compression::Raw == file_->compression_) {
+        if(nullptr != fs_->map_) {
+            if(fs_->map_size_ < position || (fs_->map_size_ - position) < original_size) {
+                return 0;
+            }
+            ::memcpy(dst, fs_->map_ + position, original_size);
+            return verify(dst) ? 1 : 0;
+        }
+        return fs_->read_raw(scratch, dst, original_size, position, fs_->direct(*file_)) && verify(dst) ? 1 : 0;
+    }
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Blocked))) {
+        if(!fs_->verify_) {
+            return original_size == read_blocks(dst, 0, original_size, nullptr, scratch) ? 1 : 0;
+        }
+        // Each block is hashed right after it is decoded, while it is still in cache.
+        XXH64_state_t* hash_state = XXH64_createState();
+        if(nullptr == hash_state) {
+            return 0;
+        }
+        XXH64_reset(hash_state, HashSeed);
+        bool result = original_size == read_blocks(dst, 0, original_size, hash_state, scratch) && XXH64_digest(hash_state) == file_->checksum_;
+        XXH64_freeState(hash_state);
+        return result ? 1 : 0;
+    }
+    // Entries compressed at once never exceed the 32 bit sizes of the codecs.
+    if(0xFFFF'FFFFULL < original_size || 0xFFFF'FFFFULL < compressed_size) {
+        return 0;
+    }
+    const u8* src = fs_->load(scratch, PacFS::Buffer::Compressed, position, static_cast<u32>(compressed_size), fs_->direct(*file_));
+    if(nullptr == src) {
+        return 0;
+    }
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Dictionary))) {
+        return decode_dictionary(file_->compression_, src, static_cast<u32>(compressed_size), static_cast<u8*>(dst), static_cast<u32>(original_size), fs_->dictionary_, fs_->dictionary_size_, fs_->zstd_dictionary_) && verify(dst) ? 1 : 0;
+    }
+    return decode(file_->compression_, src, static_cast<u32>(compressed_size), static_cast<u8*>(dst), static_cast<u32>(original_size), static_cast<u32>(original_size)) && verify(dst) ? 1 : 0;
 }
 
-bool PhyFile::is_file() const
+u64 PacFile::read_entry(void* dst, u64 offset, u64 size, Scratch& scratch)
 {
-    return is_file_;
-}
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Solid))) {
+        return read_solid(dst, offset, size, scratch);
+    }
+    u64 original_size = file_->size_offset_.original_size_;
+    u64 compressed_size = file_->size_offset_.compressed_size_;
+    u64 position = file_->size_offset_.offset_ + fs_->header_.data_;
 
-u32 PhyFile::num_children() const
-{
-    return children_.size();
+    if((u8)Compression::Raw == file_->compression_) {
+        if(nullptr != fs_->map_) {
+            if(fs_->map_size_ < position || (fs_->map_size_ - position) < original_size) {
+                return 0;
+            }
+            ::memcpy(dst, fs_->map_ + position + offset, size);
+            return size;
+        }
+        return fs_->read_raw(scratch, dst, size, position + offset, fs_->direct(*file_)) ? size : 0;
+    }
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Blocked))) {
+        return read_blocks(dst, offset, size, nullptr, scratch);
+    }
+
+    // A whole compressed entry can only be decoded from its beginning, stop as soon as the range is covered.
+    if(0xFFFF'FFFFULL < original_size || 0xFFFF'FFFFULL < compressed_size) {
+        return 0;
+    }
+    const u8* src = fs_->load(scratch, PacFS::Buffer::Compressed, position, static_cast<u32>(compressed_size), fs_->direct(*file_));
+    if(nullptr == src) {
+        return 0;
+    }
+    u32 end = static_cast<u32>(offset + size);
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Dictionary))) {
+        // Dictionary entries are small, they are decoded whole.
+        end = static_cast<u32>(original_size);
+    }
+    u8* work = 0 == offset && size == end ? (u8*)dst : (u8*)fs_->get_buffer(scratch, PacFS::Buffer::Decompressed, end);
+    if(nullptr == work) {
+        return 0;
+    }
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Dictionary))) {
+        if(!decode_dictionary(file_->compression_, src, static_cast<u32>(compressed_size), work, end, fs_->dictionary_, fs_->dictionary_size_, fs_->zstd_dictionary_)) {
+            return 0;
+        }
+    } else if(!decode(file_->compression_, src, static_cast<u32>(compressed_size), work, end, static_cast<u32>(original_size))) {
+        return 0;
+    }
+    if(work != dst) {
+        ::memcpy(dst, work + offset, size);
+    }
+    return size;
 }
 
-DirectoryIterator PhyFile::begin()
+u64 PacFile::read_blocks(void* dst, u64 offset, u64 size, XXH64_state_t* hash_state, Scratch& scratch)
 {
-    using namespace std::filesystem;
-    if(children_.size()<=0){
-        return DirectoryIterator(this, nullptr, 0);
+    assert(0 < size);
+    u64 original_size = file_->size_offset_.original_size_;
+    u64 compressed_size = file_->size_offset_.compressed_size_;
+    u32 block_size = fs_->header_.block_size_;
+    if(block_size <= 0) {
+        return 0;
     }
-    PhyFile* file = fs_->pop();
-    file->initialize(fs_, children_[0]);
-    return DirectoryIterator(this, file, 0);
+    u64 num_blocks = (original_size + block_size - 1) / block_size;
+    u64 table_size = sizeof(u64) * (num_blocks + 1);
+    if(compressed_size < table_size) {
+        return 0;
+    }
+    u64 position = file_->size_offset_.offset_ + fs_->header_.data_;
+    u64 blocks_size = compressed_size - table_size;
+
+    // Only the part of the table and the blocks which cover the range are loaded, a batch of blocks at a time.
+    u64 first = offset / block_size;
+    u64 last = (offset + size - 1) / block_size;
+    u8* d = static_cast<u8*>(dst);
+    for(u64 batch = first; batch <= last; batch += MaxBlocksPerLoad) {
+        u64 batch_last = (last - batch) < MaxBlocksPerLoad ? last : batch + MaxBlocksPerLoad - 1;
+        u32 count = static_cast<u32>(batch_last - batch + 1);
+        const u8* table = fs_->load(scratch, PacFS::Buffer::Table, position + blocks_size + sizeof(u64) * batch, sizeof(u64) * (count + 1), false);
+        if(nullptr == table) {
+            return 0;
+        }
+        u64 begin = load_u64(table);
+        u64 end = load_u64(table + sizeof(u64) * count);
+        if(end < begin || blocks_size < end || 0xFFFF'FFFFULL < (end - begin)) {
+            return 0;
+        }
+        const u8* blocks = fs_->load(scratch, PacFS::Buffer::Compressed, position + begin, static_cast<u32>(end - begin), fs_->direct(*file_));
+        if(nullptr == blocks) {
+            return 0;
+        }
+        for(u64 i = batch; i <= batch_last; ++i) {
+            u64 block_begin = load_u64(table + sizeof(u64) * (i - batch));
+            u64 block_end = load_u64(table + sizeof(u64) * (i - batch + 1));
+            if(block_end < block_begin || end < block_end || block_begin < begin) {
+                return 0;
+            }
+            u64 start = i * block_size;
+            u32 block_original = static_cast<u32>((original_size - start) < block_size ? original_size - start : block_size);
+            u32 copy_begin = static_cast<u32>((offset < start ? start : offset) - start);
+            u32 copy_end = static_cast<u32>(((offset + size) < (start + block_original) ? offset + size : start + block_original) - start);
+            const u8* src = blocks + (block_begin - begin);
+            u32 src_size = static_cast<u32>(block_end - block_begin);
+            if(0 == copy_begin && block_original == copy_end) {
+                if(!decode_block(file_->compression_, src, src_size, d + (start - offset), block_original)) {
+                    return 0;
+                }
+            } else {
+                u8* work = static_cast<u8*>(fs_->get_buffer(scratch, PacFS::Buffer::Decompressed, block_size));
+                if(!decode_block(file_->compression_, src, src_size, work, block_original)) {
+                    return 0;
+                }
+                ::memcpy(d + (start + copy_begin - offset), work + copy_begin, copy_end - copy_begin);
+            }
+            if(nullptr != hash_state) {
+                XXH64_update(hash_state, d + (start + copy_begin - offset), copy_end - copy_begin);
+            }
+        }
+    }
+    return size;
 }
 
-void PhyFile::next(DirectoryIterator& itr)
+u64 PacFile::read_solid(void* dst, u64 offset, u64 size, Scratch& scratch)
 {
-    using namespace std::filesystem;
-    assert(nullptr != itr.parent_);
-    if(nullptr == itr.file_) {
-        return;
-    }
-    itr.file_->close();
-    itr.file_ = nullptr;
-    u32 next = itr.index_ + 1;
-    if(children_.size()<=next){
-        return;
+    SharedBuffer* block = fs_->acquire_solid(*file_, scratch);
+    if(nullptr == block) {
+        return 0;
     }
-    PhyFile* file = fs_->pop();
-    file->initialize(fs_, children_[next]);
-    itr.file_ = file;
-    itr.index_ = next;
+    ::memcpy(dst, block->data() + file_->block_offset_ + offset, size);
+    block->release();
+    return size;
 }
 
-std::u8string_view PhyFile::filename() const
+bool PacFile::verify(const void* data) const
 {
-    return filename_;
+    return !fs_->verify_ || XXH64(data, file_->size_offset_.original_size_, HashSeed) == file_->checksum_;
 }
 
-u32 PhyFile::read(void* dst)
+FileView PacFile::view()
 {
     assert(nullptr != fs_);
+    assert(nullptr != file_);
+    if(!is_file()) {
+        return FileView();
+    }
+    Scratch* scratch = fs_->lease_scratch();
+    if(nullptr == scratch) {
+        return FileView();
+    }
+    FileView view = this->view(*scratch);
+    fs_->release_scratch(scratch);
+    return view;
+}
 
-    #ifdef _MSC_VER
-    FILE* file = nullptr;
-    fopen_s(&file, (const char*)filepath_.c_str(), "rb");
-    #else
-    FILE* file = fopen((const char*)filepath_.c_str(), "rb");
-    #endif
-    if(nullptr == file){
-        return 0;
+FileView PacFile::view(Scratch& scratch)
+{
+    if(fs_->tracing_) {
+        fs_->record(*file_, TraceEvent::Read);
     }
-    size_t r = fread(dst, size_, 1, file);
-    fclose(file);
-    return r;
+    u64 original_size = file_->size_offset_.original_size_;
+    if(nullptr != fs_->map_ && (u8)Compression::Raw == file_->compression_) {
+        u64 offset = file_->size_offset_.offset_ + fs_->header_.data_;
+        if(fs_->map_size_ < offset || (fs_->map_size_ - offset) < original_size) {
+            return FileView();
+        }
+        // An aligned entry owns its pages, they are read ahead at once instead of faulting one by one.
+        if(0 < original_size && fs_->aligned(offset)) {
+            fs_->advise_range(offset, original_size, PacFS::Advice::WillNeed);
+        }
+        if(!verify(fs_->map_ + offset)) {
+            return FileView();
+        }
+        return FileView(fs_->map_ + offset, original_size, nullptr);
+    }
+    if(0 != (file_->compression_ & static_cast<u8>(CompressionFlag::Solid))) {
+        SharedBuffer* block = fs_->acquire_solid(*file_, scratch);
+        if(nullptr == block) {
+            return FileView();
+        }
+        if(!verify(block->data() + file_->block_offset_)) {
+            block->release();
+            return FileView();
+        }
+        return FileView(block->data() + file_->block_offset_, original_size, block);
+    }
+    if(nullptr != fs_->cache_) {
+        SharedBuffer* buffer = fs_->acquire_cached(*this, scratch);
+        if(nullptr != buffer) {
+            return FileView(buffer->data(), original_size, buffer);
+        }
+    }
+    SharedBuffer* buffer = SharedBuffer::create(original_size);
+    if(nullptr == buffer) {
+        return FileView();
+    }
+    if(0 < original_size && read_entry(buffer->data(), scratch) <= 0) {
+        buffer->release();
+        return FileView();
+    }
+    return FileView(buffer->data(), original_size, buffer);
 }
 
-void PhyFile::initialize(PhyFS* fs, const std::filesystem::directory_entry& entry)
+void PacFile::initialize(PacFS* fs, const File* file)
 {
     assert(nullptr != fs);
-    assert(!is_hidden(entry));
-    using namespace std::filesystem;
     fs_ = fs;
-    is_file_ = entry.is_regular_file();
-    size_ = static_cast<u32>(entry.file_size());
-    filepath_ = entry.path().u8string();
-    filename_ = entry.path().filename().u8string();
-    if(!is_file_) {
-        for(const directory_entry& x: directory_iterator(entry)) {
-            if(is_hidden(x)) {
-                continue;
-            }
-            if(x.is_regular_file() || x.is_directory()) {
-                children_.push_back(x);
-            }
-        }
-    }
+    file_ = file;
 }
 
-//--- PhyFS
+//--- PacFS
 //-------------------------------------------------------------------
-PhyFS::PhyFS()
-    : opend_(0)
+PacFS::PacFS()
+    : file_(InvalidHandle)
+    , direct_(InvalidHandle)
+    , direct_threshold_(0)
+    , direct_size_(0)
+    , alignment_(0)
+    , hints_(false)
+    , map_(nullptr)
+    , map_size_(0)
+    , header_{}
+    , index_(nullptr)
+    , files_(nullptr)
+    , opend_(0)
     , pages_(nullptr)
     , entries_(nullptr)
+    , scratch_(nullptr)
+    , names_(nullptr)
+    , slots_(nullptr)
+    , dictionary_(nullptr)
+    , dictionary_size_(0)
+    , zstd_dictionary_(nullptr)
+    , verify_(false)
+    , cache_(nullptr)
+    , cache_head_(nullptr)
+    , cache_tail_(nullptr)
+    , cache_size_(0)
+    , cache_capacity_(0)
+    , solid_(nullptr)
+    , solid_offset_(0)
+    , tracing_(false)
+    , trace_start_(0)
 {
 }
 
-PhyFS::~PhyFS()
+PacFS::~PacFS()
 {
-    while(nullptr != pages_) {
-        Page* next = pages_->next_;
-        SFS_FREE(pages_);
-        pages_ = next;
-    }
-    entries_ = nullptr;
+    close();
 }
 
-bool PhyFS::open(const char* filepath)
+bool PacFS::open(const char* filepath)
+{
+    return open(filepath, Param());
+}
+
+bool PacFS::open(const char* filepath, const Param& param)
 {
     assert(nullptr != filepath);
     std::filesystem::path path(filepath);
     if(!std::filesystem::exists(path)) {
         return false;
     }
-    if(!std::filesystem::is_directory(path)) {
+    if(!std::filesystem::is_regular_file(path)) {
         return false;
     }
-    std::error_code error;
-    root_ = std::filesystem::directory_entry(path, error);
-    return error ? false : true;
+    close();
+    const u8* index = nullptr;
+    if(param.memory_map_) {
+        map_ = map_file(path, map_size_);
+        if(nullptr == map_) {
+            return false;
+        }
+        if(!parse_header(map_, map_size_, header_) || map_size_ < header_.data_) {
+            close();
+            return false;
+        }
+        // The index is used in place, the mapping keeps it alive until close.
+        index = map_ + header_size(header_.version_);
+    } else {
+        file_ = open_native(path);
+        if(InvalidHandle == file_) {
+            return false;
+        }
+        // Original packs may be smaller than the current header.
+        u8 bytes[sizeof(Header)];
+        u64 file_size = size_native(file_);
+        u64 header_bytes = file_size < sizeof(Header) ? file_size : sizeof(Header);
+        if(!read_native(file_, bytes, header_bytes, 0) || !parse_header(bytes, header_bytes, header_)) {
+            close();
+            return false;
+        }
+        size_t size = header_.data_ - header_size(header_.version_);
+        u8* buffer = (u8*)SFS_MALLOC(size);
+        index_ = buffer;
+        if(nullptr == buffer) {
+            close();
+            return false;
+        }
+        if(!read_native(file_, buffer, size, header_size(header_.version_))) {
+            close();
+            return false;
+        }
+        index = buffer;
+    }
+    index_ = index;
+    files_ = OriginalVersion == header_.version_ ? widen_entries(index, header_.num_entries_) : (File*)index;
+    if(nullptr == files_) {
+        close();
+        return false;
+    }
+    u32 index_offset = header_size(header_.version_);
+    names_ = (const char*)index + (header_.name_ - index_offset);
+    slots_ = 0 < header_.num_slots_ ? (const PathSlot*)(index + (header_.index_ - index_offset)) : nullptr;
+    if(nullptr != slots_) {
+        // Hits of the hash table are confirmed up the chain of directories.
+        parents_.resize(header_.num_entries_);
+        for(u32 i = 0; i < header_.num_entries_; ++i) {
+            parents_[i] = 0;
+        }
+        for(u32 i = 0; i < header_.num_entries_; ++i) {
+            const File& directory = files_[i];
+            if(static_cast<u8>(Type::Directory) != directory.type_) {
+                continue;
+            }
+            u64 start = directory.children_.child_start_;
+            u64 count = directory.children_.num_children_;
+            if(header_.num_entries_ < start || header_.num_entries_ - start < count) {
+                continue;
+            }
+            // Children follow their parent, which also stops cycles of a broken index.
+            for(u64 j = start; j < start + count; ++j) {
+                if(i < j) {
+                    parents_[static_cast<u32>(j)] = i;
+                }
+            }
+        }
+    }
+    if(0 < header_.dictionary_size_) {
+        // Digested once here, entries only reference it.
+        dictionary_ = index + (header_.dictionary_ - index_offset);
+        dictionary_size_ = header_.dictionary_size_;
+        zstd_dictionary_ = ZSTD_createDDict(dictionary_, dictionary_size_);
+        if(nullptr == zstd_dictionary_) {
+            close();
+            return false;
+        }
+    }
+    // Original packs have no entry checksums, their entries cannot be verified on read.
+    verify_ = param.verify_ && OriginalVersion != header_.version_;
+    hints_ = param.hints_;
+    u32 shift = (header_.flags_ >> AlignmentShift) & 0xFFU;
+    alignment_ = 0 < shift && shift < 32 ? 1U << shift : 0;
+    if(param.direct_io_ && nullptr == map_) {
+        // Without direct I/O every read takes the buffered handle, the pack stays usable.
+        direct_ = open_direct(path);
+        direct_threshold_ = param.direct_threshold_;
+    }
+    if(0 < param.cache_size_) {
+        cache_ = (CacheNode**)SFS_MALLOC(sizeof(CacheNode*) * header_.num_entries_);
+        if(nullptr == cache_) {
+            close();
+            return false;
+        }
+        ::memset(cache_, 0, sizeof(CacheNode*) * header_.num_entries_);
+        cache_capacity_ = param.cache_size_;
+    }
+    if(nullptr != param.trace_) {
+        trace_paths_.resize(header_.num_entries_);
+        for(u32 i = 0; i < trace_paths_.size(); ++i) {
+            trace_paths_[i] = 0;
+        }
+        std::string root;
+        hash_paths(files_, names_, header_.num_entries_, 0, root, trace_paths_);
+        trace_file_ = param.trace_;
+        trace_start_ = steady_nanoseconds();
+        tracing_ = true;
+    }
+    return true;
 }
 
-void PhyFS::close()
+void PacFS::close()
 {
+    if(tracing_) {
+        write_trace();
+        tracing_ = false;
+        trace_file_.clear();
+        trace_paths_.clear();
+        trace_threads_.clear();
+        trace_.clear();
+    }
+    clear_cache();
+    ZSTD_freeDDict(zstd_dictionary_);
+    zstd_dictionary_ = nullptr;
+    dictionary_ = nullptr;
+    dictionary_size_ = 0;
+    close_native(file_);
+    file_ = InvalidHandle;
+    close_native(direct_);
+    direct_ = InvalidHandle;
+    direct_size_ = 0;
+    alignment_ = 0;
+    hints_ = false;
+    clear_scratch();
+    if((const u8*)files_ != index_) {
+        SFS_FREE(files_);
+    }
+    if(nullptr != map_) {
+        unmap_file(map_, map_size_);
+        map_ = nullptr;
+        map_size_ = 0;
+    } else {
+        SFS_FREE((void*)index_);
+    }
+    index_ = nullptr;
+    files_ = nullptr;
+    names_ = nullptr;
+    slots_ = nullptr;
+    parents_.clear();
+    while(nullptr != pages_) {
+        Page* next = pages_->next_;
+        SFS_FREE(pages_);
+        pages_ = next;
+    }
+    entries_ = nullptr;
 }
 
-IFile* PhyFS::open_file(const char* filepath)
+IFile* PacFS::open_file(const char* filepath)
 {
     assert(nullptr != filepath);
     const char* begin = '/' == filepath[0] ? filepath + 1 : filepath;
     size_t len = strnlen(begin, MaxPath);
     if(len<=0){
-        PhyFile* file = pop();
-        file->initialize(this, root_);
+        PacFile* file = pop();
+        file->initialize(this, &files_[0]);
         return file;
     }
-    return open_file(root_, begin, begin + len);
+    IFile* file = nullptr != slots_ ? find_file(begin, begin + len) : open_file(0, begin, begin + len);
+    if(nullptr != file && tracing_) {
+        record(*static_cast<PacFile*>(file)->file_, TraceEvent::Open);
+    }
+    return file;
 }
 
-bool PhyFS::close_file(IFile* file)
+bool PacFS::close_file(IFile* file)
 {
     assert(nullptr != file);
+    std::lock_guard<std::mutex> lock(mutex_);
     std::uintptr_t p = (std::uintptr_t)file;
     Page* page = pages_;
     while(nullptr != page) {
         if((std::uintptr_t)page < p && p < ((std::uintptr_t)page + PageSize)) {
             Entry* f = (Entry*)file;
-            f->file_.~PhyFile();
+            f->file_.~PacFile();
             push(f);
             return true;
         }
@@ -741,300 +3727,587 @@ bool PhyFS::close_file(IFile* file)
     return false;
 }
 
-IFile* PhyFS::open_file(const std::filesystem::directory_entry& root, const char* begin, const char* end)
+IFile* PacFS::open_file(u32 root, const char* begin, const char* end)
 {
-    using namespace std::filesystem;
     size_t len = name_length(begin, end);
     const char* next = '/' == begin[len] ? begin + len + 1 : begin + len;
-    for(const directory_entry& x: directory_iterator(root)) {
-        if(is_hidden(x)) {
+    const File& root_file = files_[root];
+    if(root_file.type_ != (u8)Type::Directory) {
+        return nullptr;
+    }
+    u32 index = find_child(root_file, begin, len);
+    if(header_.num_entries_ <= index) {
+        return nullptr;
+    }
+    if('\0' == next[0]) {
+        PacFile* file = pop();
+        file->initialize(this, &files_[index]);
+        return file;
+    }
+    return open_file(index, next, end);
+}
+
+u32 PacFS::find_child(const File& directory, const char* name, size_t length) const
+{
+    u32 start = static_cast<u32>(directory.children_.child_start_);
+    u32 count = static_cast<u32>(directory.children_.num_children_);
+    if(0 == (header_.flags_ & static_cast<u32>(HeaderFlag::SortedChildren))) {
+        for(u32 i = 0; i < count; ++i) {
+            const File& entry = files_[start + i];
+            if(equals(entry.name_length_, &names_[entry.name_offset_], length, name)) {
+                return start + i;
+            }
+        }
+        return header_.num_entries_;
+    }
+    if(count <= 0) {
+        return header_.num_entries_;
+    }
+    // Lower bound without data dependent branches on the search position.
+    const File* base = &files_[start];
+    const File* last = base + count;
+    while(1 < count) {
+        u32 half = count >> 1;
+        const File& entry = base[half];
+        base += compare(entry.name_length_, &names_[entry.name_offset_], length, name) < 0 ? half : 0;
+        count -= half;
+    }
+    base += compare(base->name_length_, &names_[base->name_offset_], length, name) < 0 ? 1 : 0;
+    if(last <= base || !equals(base->name_length_, &names_[base->name_offset_], length, name)) {
+        return header_.num_entries_;
+    }
+    return static_cast<u32>(std::distance(static_cast<const File*>(files_), base));
+}
+
+IFile* PacFS::find_file(const char* begin, const char* end)
+{
+    assert(nullptr != slots_);
+    if(begin < end && '/' == end[-1]) {
+        --end;
+    }
+    u64 hash = path_hash(begin, static_cast<size_t>(std::distance(begin, end)));
+    u32 mask = header_.num_slots_ - 1;
+    for(u32 slot = static_cast<u32>(hash) & mask; 0 != slots_[slot].index_; slot = (slot + 1) & mask) {
+        if(hash != slots_[slot].hash_ || header_.num_entries_ <= slots_[slot].index_) {
             continue;
         }
-        if(equals(x, len, begin)) {
-            if('\0' == next[0]) {
-                PhyFile* file = pop();
-                file->initialize(this, x);
-                return file;
-            }
-            return open_file(x, next, end);
+        if(!match_path(slots_[slot].index_, begin, end)) {
+            // Another path with the same hash, the walk down the directories decides.
+            return open_file(0, begin, end);
         }
+        PacFile* file = pop();
+        file->initialize(this, &files_[slots_[slot].index_]);
+        return file;
     }
     return nullptr;
 }
 
-PhyFile* PhyFS::pop()
+bool PacFS::match_path(u32 index, const char* begin, const char* end) const
 {
-    if(nullptr == entries_) {
-        alloc_page();
-        assert(nullptr != entries_);
+    // Compare the components from the last one up to the root.
+    while(0 != index) {
+        const char* name = end;
+        while(begin < name && '/' != name[-1]) {
+            --name;
+        }
+        const File& entry = files_[index];
+        if(!equals(entry.name_length_, &names_[entry.name_offset_], static_cast<size_t>(std::distance(name, end)), name)) {
+            return false;
+        }
+        index = parents_[index];
+        if(name <= begin) {
+            return 0 == index;
+        }
+        end = name - 1;
     }
-    Entry* entry = entries_;
-    entries_ = entries_->next_;
-    ++opend_;
-    return new(&entry->file_) PhyFile();
+    return false;
 }
 
-void PhyFS::push(Entry* f)
+bool PacFS::verify()
 {
-    --opend_;
-    f->next_ = entries_;
-    entries_ = f;
+    return verify(0);
 }
 
-void PhyFS::alloc_page()
+bool PacFS::verify(u32 num_threads)
 {
-    Page* page = (Page*)SFS_MALLOC(PageSize);
-    Entry* entries = reinterpret_cast<Entry*>(&page[1]);
-    u32 num_entries = (PageSize - sizeof(Page)) / sizeof(Entry);
-    assert(num_entries * sizeof(Entry) <= (PageSize - sizeof(Page)));
-    for(u32 i = 1; i < num_entries; ++i) {
-        entries[i - 1].next_ = &entries[i];
+    if(nullptr == index_) {
+        return false;
+    }
+    u64 file_size = nullptr != map_ ? map_size_ : size_native(file_);
+    u64 metadata_size = header_.data_ - header_size(header_.version_);
+    if(OriginalVersion == header_.version_) {
+        // Original packs hash the metadata and the data section in one sequential pass.
+        if(file_size < header_.data_) {
+            return false;
+        }
+        if(hints_) {
+            advise_range(header_.data_, 0, Advice::Sequential);
+        }
+        Scratch* scratch = lease_scratch();
+        if(nullptr == scratch) {
+            return false;
+        }
+        XXH64_state_t* hash_state = XXH64_createState();
+        XXH64_reset(hash_state, HashSeed);
+        // The original builder hashed the metadata first, with the entries as they were before the data was written.
+        u64 entries_size = entry_size(header_.version_) * header_.num_entries_;
+        hash_original_entries(hash_state, index_, header_.num_entries_);
+        XXH64_update(hash_state, index_ + entries_size, static_cast<size_t>(metadata_size - entries_size));
+        bool result = true;
+        for(u64 position = header_.data_; result && position < file_size; position += HashChunkSize) {
+            u32 size = static_cast<u32>((file_size - position) < HashChunkSize ? file_size - position : HashChunkSize);
+            const u8* data = load(*scratch, Buffer::Compressed, position, size, InvalidHandle != direct_);
+            result = nullptr != data;
+            if(result) {
+                XXH64_update(hash_state, data, size);
+            }
+        }
+        result = result && XXH64_digest(hash_state) == header_.hash_;
+        XXH64_freeState(hash_state);
+        release_scratch(scratch);
+        if(hints_) {
+            advise_range(header_.data_, 0, Advice::Normal);
+        }
+        return result;
     }
-    entries[num_entries - 1].next_ = entries_;
-    entries_ = entries;
-    page->next_ = pages_;
-    pages_ = page;
-}
 
-//--- PacFile
-//-------------------------------------------------------------------
-PacFile::PacFile()
-    : fs_(nullptr)
-    , file_(nullptr)
-{
-}
+    Array<u64> chunks;
+    Array<BuildRecord> records;
+    if(!load_chunks(chunks, records)) {
+        return false;
+    }
+    u64 chunk_size = header_.chunk_size_;
+    u64 num_chunks = chunks.size();
 
-PacFile::~PacFile()
-{
-    fs_ = nullptr;
-    file_ = nullptr;
+    // Threads take chunks in turn, the first mismatch stops all of them.
+    // The pass reads everything once, hashed chunks are dropped from the page cache instead of evicting hot pages.
+    if(hints_) {
+        advise_range(header_.data_, header_.chunks_ - header_.data_, Advice::Sequential);
+    }
+    std::atomic<u64> next = 0;
+    std::atomic<bool> result = true;
+    auto work = [&]() {
+        u8* buffer = nullptr == map_ ? static_cast<u8*>(SFS_MALLOC_ALIGNED(static_cast<size_t>(chunk_size), DirectAlignment)) : nullptr;
+        Scratch* scratch = nullptr == map_ ? lease_scratch() : nullptr;
+        if(nullptr == map_ && (nullptr == buffer || nullptr == scratch)) {
+            SFS_FREE(buffer);
+            if(nullptr != scratch) {
+                release_scratch(scratch);
+            }
+            result = false;
+            return;
+        }
+        for(u64 i = next++; i < num_chunks && result; i = next++) {
+            u64 position = header_.data_ + chunk_size * i;
+            u64 size = (header_.chunks_ - position) < chunk_size ? header_.chunks_ - position : chunk_size;
+            const u8* data = map_ + position;
+            if(nullptr == map_) {
+                // A whole pack pass is the one-shot read which should not evict the working set of others.
+                if(!read_raw(*scratch, buffer, size, position, InvalidHandle != direct_)) {
+                    result = false;
+                    break;
+                }
+                data = buffer;
+            }
+            if(XXH64(data, static_cast<size_t>(size), HashSeed) != chunks[static_cast<u32>(i)]) {
+                result = false;
+            }
+            if(hints_ && nullptr == map_) {
+                advise_range(position, size, Advice::DontNeed);
+            }
+        }
+        SFS_FREE(buffer);
+        if(nullptr != scratch) {
+            release_scratch(scratch);
+        }
+    };
+    num_threads = 0 < num_threads ? num_threads : std::thread::hardware_concurrency();
+    num_threads = num_threads <= 0 ? 1 : num_threads;
+    num_threads = num_chunks < num_threads ? static_cast<u32>(num_chunks) : num_threads;
+    Array<std::thread*> threads;
+    for(u32 i = 1; i < num_threads; ++i) {
+        threads.push_back(new std::thread(work));
+    }
+    work();
+    for(u32 i = 0; i < threads.size(); ++i) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    if(hints_) {
+        advise_range(header_.data_, header_.chunks_ - header_.data_, Advice::Normal);
+    }
+    return result;
 }
 
-void PacFile::close()
+bool PacFS::load_chunks(Array<u64>& chunks, Array<BuildRecord>& records)
 {
-    if(nullptr != fs_) {
-        fs_->close_file(this);
-        fs_ = nullptr;
+    if(nullptr == index_ || header_.chunk_size_ <= 0 || header_.chunks_ < header_.data_ || header_.records_ < header_.chunks_) {
+        return false;
     }
-    file_ = nullptr;
+    u64 file_size = nullptr != map_ ? map_size_ : size_native(file_);
+    u64 metadata_size = header_.data_ - header_size(header_.version_);
+    u64 chunk_size = header_.chunk_size_;
+    u64 num_chunks = (header_.chunks_ - header_.data_ + chunk_size - 1) / chunk_size;
+    u64 num_records = header_.num_entries_;
+    if(header_.chunks_ + sizeof(u64) * num_chunks != header_.records_ || file_size < header_.records_ || (file_size - header_.records_) < sizeof(BuildRecord) * num_records) {
+        return false;
+    }
+    chunks.resize(static_cast<u32>(num_chunks));
+    records.resize(static_cast<u32>(num_records));
+    if(0 < num_chunks) {
+        if(nullptr != map_) {
+            ::memcpy(&chunks[0], map_ + header_.chunks_, sizeof(u64) * num_chunks);
+        } else if(!read_native(file_, &chunks[0], sizeof(u64) * num_chunks, header_.chunks_)) {
+            return false;
+        }
+    }
+    if(nullptr != map_) {
+        ::memcpy(&records[0], map_ + header_.records_, sizeof(BuildRecord) * num_records);
+    } else if(!read_native(file_, &records[0], sizeof(BuildRecord) * num_records, header_.records_)) {
+        return false;
+    }
+    // The header is hashed as it was written, before Header::hash_ was filled in.
+    Header header = header_;
+    header.hash_ = 0;
+    XXH64_state_t* hash_state = XXH64_createState();
+    XXH64_reset(hash_state, HashSeed);
+    XXH64_update(hash_state, &header, sizeof(Header));
+    XXH64_update(hash_state, index_, static_cast<size_t>(metadata_size));
+    u64 metadata = XXH64_digest(hash_state);
+    XXH64_freeState(hash_state);
+    return root_hash(metadata, chunks, records) == header_.hash_;
 }
 
-u32 PacFile::original_size() const
+void PacFS::advise(Advice advice)
 {
-    return file_->type_==(u8)Type::File? file_->size_offset_.original_size_ : 0;
+    advise_range(0, 0, advice);
 }
 
-u32 PacFile::compressed_size() const
+void PacFS::advise(IFile* file, Advice advice)
 {
-    return file_->type_==(u8)Type::File? file_->size_offset_.compressed_size_ : 0;
+    assert(nullptr != file);
+    const File& entry = *static_cast<PacFile*>(file)->file_;
+    if(static_cast<u8>(Type::File) == entry.type_) {
+        advise_range(header_.data_ + entry.size_offset_.offset_, entry.size_offset_.compressed_size_, advice);
+        return;
+    }
+    u64 start = entry.children_.child_start_;
+    u64 count = entry.children_.num_children_;
+    if(header_.num_entries_ < start || header_.num_entries_ - start < count) {
+        return;
+    }
+    // Siblings are mostly stored next to each other, neighbouring ranges go out as one hint.
+    u64 budget = Advice::WillNeed == advice ? ReadaheadLimit : ~0ULL;
+    u64 begin = 0;
+    u64 end = 0;
+    for(u64 i = start; i < start + count && 0 < budget; ++i) {
+        const File& child = files_[i];
+        u64 size = child.size_offset_.compressed_size_;
+        if(static_cast<u8>(Type::File) != child.type_ || size <= 0) {
+            continue;
+        }
+        size = budget < size ? budget : size;
+        budget -= size;
+        u64 position = header_.data_ + child.size_offset_.offset_;
+        if(begin < end && begin <= position && position <= end + AdviceGap) {
+            end = end < position + size ? position + size : end;
+            continue;
+        }
+        if(begin < end) {
+            advise_range(begin, end - begin, advice);
+        }
+        begin = position;
+        end = position + size;
+    }
+    if(begin < end) {
+        advise_range(begin, end - begin, advice);
+    }
 }
 
-bool PacFile::is_file() const
+u64 PacFS::direct_size() const
 {
-    return file_->type_==(u8)Type::File;
+    return direct_size_.load(std::memory_order_relaxed);
 }
 
-u32 PacFile::num_children() const
+const u8* PacFS::load(Scratch& scratch, Buffer buffer, u64 position, u32 size, bool direct)
 {
-    return file_->type_==(u8)Type::Directory? file_->children_.num_children_ : 0;
+    if(nullptr != map_) {
+        if(map_size_ < position || (map_size_ - position) < size) {
+            return nullptr;
+        }
+        return map_ + position;
+    }
+    void* dst = get_buffer(scratch, buffer, size);
+    if(nullptr == dst || !read_raw(scratch, dst, size, position, direct)) {
+        return nullptr;
+    }
+    return static_cast<const u8*>(dst);
 }
 
-DirectoryIterator PacFile::begin()
+SharedBuffer* PacFS::acquire_cached(PacFile& file, Scratch& scratch)
 {
-    if(file_->type_ != (u8)Type::Directory || file_->children_.num_children_<=0){
-        return DirectoryIterator(this, nullptr, 0);
+    const File& entry = *file.file_;
+    u64 size = entry.size_offset_.original_size_;
+    // Entries read past the page cache are streamed, keeping them would evict the hot ones just the same.
+    if(cache_capacity_ < size || (nullptr != map_ && (u8)Compression::Raw == entry.compression_) || direct(entry)) {
+        return nullptr;
     }
-    PacFile* file = fs_->pop();
-    const File& child = fs_->files_[file_->children_.child_start_];
-    file->initialize(fs_, &child);
-    return DirectoryIterator(this, file, 0);
+    u32 index = static_cast<u32>(&entry - files_);
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        CacheNode* node = cache_[index];
+        if(nullptr != node) {
+            unlink(node);
+            link_front(node);
+            node->buffer_->add_reference();
+            return node->buffer_;
+        }
+    }
+
+    // Decompress outside of the lock, concurrent misses on the same entry only cost a second decompression.
+    SharedBuffer* buffer = SharedBuffer::create(size);
+    if(nullptr == buffer) {
+        return nullptr;
+    }
+    if(0 < size && file.read_entry(buffer->data(), scratch) <= 0) {
+        buffer->release();
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    CacheNode* node = cache_[index];
+    if(nullptr != node) {
+        unlink(node);
+        link_front(node);
+        node->buffer_->add_reference();
+        buffer->release();
+        return node->buffer_;
+    }
+    node = (CacheNode*)SFS_MALLOC(sizeof(CacheNode));
+    if(nullptr == node) {
+        return buffer;
+    }
+    buffer->add_reference();
+    node->buffer_ = buffer;
+    node->entry_ = index;
+    link_front(node);
+    cache_[index] = node;
+    cache_size_ += size;
+    while(cache_capacity_ < cache_size_ && node != cache_tail_) {
+        CacheNode* tail = cache_tail_;
+        unlink(tail);
+        cache_[tail->entry_] = nullptr;
+        cache_size_ -= tail->buffer_->size_;
+        tail->buffer_->release();
+        SFS_FREE(tail);
+    }
+    return buffer;
 }
 
-void PacFile::next(DirectoryIterator& itr)
+SharedBuffer* PacFS::acquire_solid(const File& entry, Scratch& scratch)
 {
-    assert(nullptr != itr.parent_);
-    if(nullptr == itr.file_) {
-        return;
+    u64 offset = entry.size_offset_.offset_;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if(nullptr != solid_ && offset == solid_offset_) {
+            solid_->add_reference();
+            return solid_;
+        }
     }
-    itr.file_->close();
-    itr.file_ = nullptr;
-    u32 next = itr.index_ + 1;
-    if(file_->children_.num_children_<=next){
-        return;
+    u64 compressed_size = entry.size_offset_.compressed_size_;
+    if(compressed_size <= sizeof(u32) || 0xFFFF'FFFFULL < compressed_size) {
+        return nullptr;
     }
-    PacFile* file = fs_->pop();
-    const File& child = fs_->files_[file_->children_.child_start_+next];
-    file->initialize(fs_, &child);
-    itr.file_ = file;
-    itr.index_ = next;
+    const u8* src = load(scratch, Buffer::Compressed, offset + header_.data_, static_cast<u32>(compressed_size), false);
+    if(nullptr == src) {
+        return nullptr;
+    }
+    u32 size;
+    ::memcpy(&size, src, sizeof(u32));
+    if(size < entry.block_offset_ || (size - entry.block_offset_) < entry.size_offset_.original_size_) {
+        return nullptr;
+    }
+    SharedBuffer* block = SharedBuffer::create(size);
+    if(nullptr == block) {
+        return nullptr;
+    }
+    if(!decode(entry.compression_, src + sizeof(u32), static_cast<u32>(compressed_size - sizeof(u32)), block->data(), size, size)) {
+        block->release();
+        return nullptr;
+    }
+    // Siblings are usually read in sequence, keep this block for them.
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if(nullptr != solid_) {
+        solid_->release();
+    }
+    block->add_reference();
+    solid_ = block;
+    solid_offset_ = offset;
+    return block;
 }
 
-std::u8string_view PacFile::filename() const
+void PacFS::clear_cache()
 {
-    return std::u8string_view((const char8_t*)&fs_->names_[file_->name_offset_], file_->name_length_);
+    while(nullptr != cache_head_) {
+        CacheNode* next = cache_head_->next_;
+        cache_head_->buffer_->release();
+        SFS_FREE(cache_head_);
+        cache_head_ = next;
+    }
+    cache_tail_ = nullptr;
+    cache_size_ = 0;
+    if(nullptr != solid_) {
+        solid_->release();
+        solid_ = nullptr;
+    }
+    cache_capacity_ = 0;
+    SFS_FREE(cache_);
+    cache_ = nullptr;
 }
 
-u32 PacFile::read(void* dst)
+void PacFS::unlink(CacheNode* node)
 {
-    assert(nullptr != fs_);
-    assert(nullptr != file_);
-    assert(is_file());
-    u32 original_size = file_->size_offset_.original_size_;
-    u32 compressed_size = file_->size_offset_.compressed_size_;
-    u64 offset = file_->size_offset_.offset_ + fs_->header_.data_;
-
-    SFS_FSEEK(fs_->file_, static_cast<int64_t>(offset), SEEK_SET);
-    if((u8)Compression::Raw == file_->compression_){
-        return ::fread(dst, original_size, 1, fs_->file_);
+    if(nullptr != node->prev_) {
+        node->prev_->next_ = node->next_;
+    } else {
+        cache_head_ = node->next_;
     }
-    void* buffer = fs_->get_buffer(compressed_size);
-    if(::fread(buffer, compressed_size, 1, fs_->file_)<=0){
-        return 0;
+    if(nullptr != node->next_) {
+        node->next_->prev_ = node->prev_;
+    } else {
+        cache_tail_ = node->prev_;
     }
-    int32_t r = LZ4_decompress_safe((const char*)buffer, (char*)dst, static_cast<int32_t>(compressed_size), static_cast<int32_t>(original_size));
-    return original_size == static_cast<u32>(r) ? 1 : 0;
+    node->prev_ = nullptr;
+    node->next_ = nullptr;
 }
 
-void PacFile::initialize(PacFS* fs, const File* file)
+void PacFS::link_front(CacheNode* node)
 {
-    assert(nullptr != fs);
-    fs_ = fs;
-    file_ = file;
+    node->prev_ = nullptr;
+    node->next_ = cache_head_;
+    if(nullptr != cache_head_) {
+        cache_head_->prev_ = node;
+    } else {
+        cache_tail_ = node;
+    }
+    cache_head_ = node;
 }
 
-//--- PacFS
-//-------------------------------------------------------------------
-PacFS::PacFS()
-    : file_(0)
-    , header_{}
-    , files_(nullptr)
-    , opend_(0)
-    , pages_(nullptr)
-    , entries_(nullptr)
-    , names_(nullptr)
+void PacFS::advise_range(u64 position, u64 size, Advice advice)
 {
+    if(nullptr != map_) {
+        advise_map(map_, map_size_, position, size, advice);
+    } else if(InvalidHandle != file_) {
+        advise_native(file_, position, size, advice);
+    }
 }
 
-PacFS::~PacFS()
+bool PacFS::aligned(u64 position) const
 {
-    close();
+    return DirectAlignment <= alignment_ && 0 == (position & (DirectAlignment - 1));
 }
 
-bool PacFS::open(const char* filepath)
+bool PacFS::direct(const File& entry) const
 {
-    assert(nullptr != filepath);
-    std::filesystem::path path(filepath);
-    if(!std::filesystem::exists(path)) {
-        return false;
-    }
-    if(!std::filesystem::is_regular_file(path)) {
-        return false;
-    }
-    close();
-#ifdef _MSC_VER
-    fopen_s(&file_, (const char*)path.u8string().c_str(), "rb");
-#else
-    file_ = fopen((const char*)path.u8string().c_str(), "rb");
-#endif
-    if(nullptr == file_){
-        return false;
-    }
-    if(fread(&header_, sizeof(Header), 1, file_)<=0 || Magic != header_.magic_){
-        fclose(file_);
-        file_ = nullptr;
-        return false;
-    }
-    size_t size_entries = sizeof(File)*header_.num_entries_;
-    size_t size_names = (header_.data_-header_.name_+0x03UL) & ~0x03UL;
-    size_t size = size_entries + size_names;
-    files_ = (File*)SFS_MALLOC(size);
-    names_ = (const char*)files_ + size_entries;
-    if(nullptr == files_){
-        fclose(file_);
-        file_ = nullptr;
-        return false;
-    }
-    if(fread(files_, size, 1, file_)<=0){
-        SFS_FREE(files_);
-        files_ = nullptr;
-        fclose(file_);
-        file_ = nullptr;
-        return false;
-    }
-    return true;
+    return InvalidHandle != direct_ && direct_threshold_ <= entry.size_offset_.original_size_;
 }
 
-void PacFS::close()
+bool PacFS::read_raw(Scratch& scratch, void* dst, u64 size, u64 position, bool direct)
 {
-    if(nullptr != file_) {
-        fclose(file_);
-        file_ = nullptr;
-    }
-    SFS_FREE(files_);
-    files_ = nullptr;
-    names_ = nullptr;
-    while(nullptr != pages_) {
-        Page* next = pages_->next_;
-        SFS_FREE(pages_);
-        pages_ = next;
+    // A file system which refuses a direct read still serves it through the page cache.
+    if(direct && InvalidHandle != direct_ && read_direct(scratch, dst, size, position)) {
+        direct_size_.fetch_add(size, std::memory_order_relaxed);
+        return true;
     }
-    entries_ = nullptr;
+    return read_native(file_, dst, size, position);
 }
 
-IFile* PacFS::open_file(const char* filepath)
+bool PacFS::read_direct(Scratch& scratch, void* dst, u64 size, u64 position)
 {
-    assert(nullptr != filepath);
-    const char* begin = '/' == filepath[0] ? filepath + 1 : filepath;
-    size_t len = strnlen(begin, MaxPath);
-    if(len<=0){
-        PacFile* file = pop();
-        file->initialize(this, &files_[0]);
-        return file;
+    u8* d = static_cast<u8*>(dst);
+    // Whole pages go straight into an aligned destination, the rest through a bounce buffer of this read.
+    if(0 == (position & (DirectAlignment - 1)) && 0 == (reinterpret_cast<std::uintptr_t>(d) & (DirectAlignment - 1))) {
+        u64 body = size & ~static_cast<u64>(DirectAlignment - 1);
+        if(!read_native(direct_, d, body, position)) {
+            return false;
+        }
+        d += body;
+        size -= body;
+        position += body;
+    }
+    while(0 < size) {
+        u64 begin = position & ~static_cast<u64>(DirectAlignment - 1);
+        u64 skip = position - begin;
+        u64 chunk = (DirectChunkSize - skip) < size ? DirectChunkSize - skip : size;
+        u64 length = (skip + chunk + DirectAlignment - 1) & ~static_cast<u64>(DirectAlignment - 1);
+        u8* bounce = static_cast<u8*>(get_buffer(scratch, Buffer::Direct, static_cast<u32>(length)));
+        // The last page may end past the end of the file, only the requested bytes have to arrive.
+        if(nullptr == bounce || read_native_partial(direct_, bounce, length, begin) < skip + chunk) {
+            return false;
+        }
+        ::memcpy(d, bounce + skip, static_cast<size_t>(chunk));
+        d += chunk;
+        size -= chunk;
+        position += chunk;
     }
-    return open_file(0, begin, begin + len);
+    return true;
 }
 
-bool PacFS::close_file(IFile* file)
+void PacFS::record(const File& entry, TraceEvent event)
 {
-    assert(nullptr != file);
-    std::uintptr_t p = (std::uintptr_t)file;
-    Page* page = pages_;
-    while(nullptr != page) {
-        if((std::uintptr_t)page < p && p < ((std::uintptr_t)page + PageSize)) {
-            Entry* f = (Entry*)file;
-            f->file_.~PacFile();
-            push(f);
-            return true;
+    if(static_cast<u8>(Type::File) != entry.type_) {
+        return;
+    }
+    TraceRecord record;
+    record.index_ = static_cast<u32>(std::distance(static_cast<const File*>(files_), &entry));
+    record.path_ = trace_paths_[record.index_];
+    record.time_ = steady_nanoseconds() - trace_start_;
+    record.event_ = static_cast<u16>(event);
+    // A thread looks its number up once per trace, later records only append under the lock.
+    struct TraceThread
+    {
+        const PacFS* fs_;
+        u64 start_;
+        u16 id_;
+    };
+    thread_local TraceThread current = {nullptr, 0, 0};
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    if(this != current.fs_ || trace_start_ != current.start_) {
+        u64 thread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+        u32 id = 0;
+        while(id < trace_threads_.size() && thread != trace_threads_[id]) {
+            ++id;
         }
-        page = page->next_;
+        if(trace_threads_.size() <= id) {
+            trace_threads_.push_back(thread);
+        }
+        current = {this, trace_start_, static_cast<u16>(id)};
     }
-    return false;
+    record.thread_ = current.id_;
+    trace_.push_back(record);
 }
 
-IFile* PacFS::open_file(u32 root, const char* begin, const char* end)
+void PacFS::write_trace()
 {
-    size_t len = name_length(begin, end);
-    const char* next = '/' == begin[len] ? begin + len + 1 : begin + len;
-    File& root_file = files_[root];
-    assert(root_file.type_ == (u8)Type::Directory);
-    for(u32 i=0; i<root_file.children_.num_children_; ++i){
-        u32 index = root_file.children_.child_start_+i;
-        const File& entry = files_[index];
-        const char* filename = &names_[entry.name_offset_];
-        if(equals(entry.name_length_, filename, len, begin)){
-            if('\0' == next[0]) {
-                PacFile* file = pop();
-                file->initialize(this, &entry);
-                return file;
-            }
-            return open_file(index, next, end);
-        }
+    // Records stay in memory until now, tracing does not add I/O to the accesses it measures.
+#ifdef _MSC_VER
+    FILE* f = nullptr;
+    fopen_s(&f, (const char*)trace_file_.u8string().c_str(), "wb");
+#else
+    FILE* f = fopen((const char*)trace_file_.u8string().c_str(), "wb");
+#endif
+    if(nullptr == f) {
+        return;
     }
-    return nullptr;
+    TraceHeader header = {TraceMagic, TraceVersion};
+    if(0 < fwrite(&header, sizeof(TraceHeader), 1, f) && 0 < trace_.size()) {
+        fwrite(&trace_[0], sizeof(TraceRecord) * trace_.size(), 1, f);
+    }
+    fclose(f);
 }
 
 PacFile* PacFS::pop()
 {
+    std::lock_guard<std::mutex> lock(mutex_);
     if(nullptr == entries_) {
         alloc_page();
         assert(nullptr != entries_);
@@ -1067,9 +4340,58 @@ void PacFS::alloc_page()
     pages_ = page;
 }
 
-void* PacFS::get_buffer(u32 size)
+Scratch* PacFS::lease_scratch()
+{
+    // Each read takes its own scratch, so concurrent reads do not share it and the pack owns all of it.
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(nullptr != scratch_) {
+            Scratch* scratch = scratch_;
+            scratch_ = scratch->next_;
+            return scratch;
+        }
+    }
+    void* memory = SFS_MALLOC(sizeof(Scratch));
+    if(nullptr == memory) {
+        return nullptr;
+    }
+    Scratch* scratch = new(memory) Scratch();
+    scratch->next_ = nullptr;
+    return scratch;
+}
+
+void PacFS::release_scratch(Scratch* scratch)
+{
+    assert(nullptr != scratch);
+    // Buffers of an occasional huge entry are not kept around.
+    for(u32 i = 0; i < NumScratchBuffers; ++i) {
+        if(ScratchLimit < scratch->buffers_[i].size()) {
+            scratch->buffers_[i].clear();
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    scratch->next_ = scratch_;
+    scratch_ = scratch;
+}
+
+void PacFS::clear_scratch()
 {
-    return buffer_pool_.get(size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    while(nullptr != scratch_) {
+        Scratch* next = scratch_->next_;
+        scratch_->~Scratch();
+        SFS_FREE(scratch_);
+        scratch_ = next;
+    }
+}
+
+void* PacFS::get_buffer(Scratch& scratch, Buffer buffer, u32 size)
+{
+    static_assert(NumScratchBuffers == static_cast<u32>(Buffer::Max));
+    if(Buffer::Direct == buffer) {
+        return scratch.buffers_[static_cast<u32>(buffer)].get(size, DirectAlignment);
+    }
+    return scratch.buffers_[static_cast<u32>(buffer)].get(size);
 }
 
 //--- VFS
@@ -1100,10 +4422,15 @@ bool VFS::add_phyfs(const char* root)
 }
 
 bool VFS::add_pacfs(const char* file)
+{
+    return add_pacfs(file, PacFS::Param());
+}
+
+bool VFS::add_pacfs(const char* file, const PacFS::Param& param)
 {
     assert(nullptr != file);
     PacFS* fs = new PacFS();
-    if(!fs->open(file)) {
+    if(!fs->open(file, param)) {
         delete fs;
         return false;
     }
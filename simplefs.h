@@ -1,9 +1,12 @@
+#include <atomic>
 #include <cstdint>
 #include <type_traits>
 #include <string_view>
 #include <filesystem>
+#include <mutex>
 
 struct XXH64_state_s;
+struct ZSTD_DDict_s;
 
 namespace std
 {
@@ -25,8 +28,11 @@ using u16 = uint16_t;
 using u32 = uint32_t;
 using u64 = uint64_t;
 
-inline static constexpr u32 Magic = 0x70616330UL;
+inline static constexpr u32 Magic = 0x70616331UL;
+inline static constexpr u32 Version = 1; //!< PacFS reads this version and the unversioned original format
 inline static constexpr u64 HashSeed = 0x3AE8'2BF0'AF08'73F2ULL;
+inline static constexpr u32 TraceMagic = 0x74726331UL;
+inline static constexpr u32 TraceVersion = 1;
 
 enum class Type
 {
@@ -34,26 +40,78 @@ enum class Type
     Directory,
 };
 
+enum class HeaderFlag : u32
+{
+    SortedChildren = 0x01U, //!< children of each directory are sorted by name
+};
+inline static constexpr u32 AlignmentShift = 8; //!< bits 8 to 15 of Header::flags_ hold the log2 of the alignment of aligned entries, 0 if there are none
+
 enum class Compression : u8
 {
     Raw = 0,
     LZ4,
+    Zstd,
+};
+
+/**
+ * Flags stored in the upper bits of File::compression_, the lower bits hold Compression.
+ */
+enum class CompressionFlag : u8
+{
+    Blocked = 0x80U, //!< independently compressed blocks of Header::block_size_ followed by a table of u64 block offsets
+    Dictionary = 0x40U, //!< compressed with the shared dictionary of the archive
+    Solid = 0x20U, //!< member of a solid block, a u32 uncompressed size followed by the compressed concatenation of small files
 };
+inline static constexpr u8 CompressionMask = 0x0FU;
 
 struct Header
 {
     u32 magic_;
+    u32 version_;
     u32 num_entries_;
     u32 name_;
+    u32 index_;     //!< offset of the path hash table, 0 if there is none
+    u32 num_slots_; //!< number of slots of the path hash table, a power of two
     u32 data_;
+    u32 flags_;     //!< combination of HeaderFlag and the entry alignment above AlignmentShift
+    u32 block_size_; //!< uncompressed size of a block of blocked entries
+    u32 dictionary_; //!< offset of the shared dictionary, 0 if there is none
+    u32 dictionary_size_;
+    u32 chunk_size_; //!< bytes of the data section covered by each chunk hash, 0 if there are none
+    u64 hash_;       //!< XXH64 of the hash of the header with hash_ at 0 and everything up to the data section, followed by the chunk hashes and the build records
+    u64 chunks_;     //!< offset of the u64 XXH64 of each chunk, the table follows the data section
+    u64 records_;    //!< offset of one BuildRecord per entry, the table follows the chunk hashes
+};
+
+/**
+ * Slot of the path hash table.
+ * Keyed by the hash of the full path without leading and trailing separators,
+ * linear probing, index 0 (the root) marks an empty slot.
+ */
+struct PathSlot
+{
     u64 hash_;
+    u32 index_;
+    u32 reserved_;
+};
+
+/**
+ * Bookkeeping of the builder for an entry, only Builder reads it to reuse the entries of a previous pack.
+ */
+struct BuildRecord
+{
+    s64 mtime_;   //!< last write time of the source file in ticks of std::filesystem::file_time_type, 0 for directories
+    s16 level_;   //!< effective codec level of a compressed entry, 0 if unknown
+    u8 rejected_; //!< compression which missed Builder::Param::maximum_ratio_ for a raw entry, 0 if none
+    u8 ratio_;    //!< percent the rejected compression reached, at most 255
+    u32 reserved_;
 };
 
 struct SizeOffset
 {
     u64 offset_;
-    u32 original_size_;
-    u32 compressed_size_;
+    u64 original_size_;
+    u64 compressed_size_;
 };
 
 struct Children
@@ -69,12 +127,39 @@ struct File
         SizeOffset size_offset_;
         Children children_;
     };
+    u64 checksum_; //!< XXH64 of the uncompressed contents of a file
+    u32 block_offset_; //!< offset of a solid entry within its uncompressed solid block
+    u32 reserved_;
     u32 name_offset_;
     u16 name_length_;
     u8 type_;
     u8 compression_;
 };
 
+enum class TraceEvent : u16
+{
+    Open = 0,
+    Read,
+};
+
+/**
+ * Access trace written by PacFS, the header is followed by one TraceRecord per access in the order they happened.
+ */
+struct TraceHeader
+{
+    u32 magic_;
+    u32 version_;
+};
+
+struct TraceRecord
+{
+    u64 path_;   //!< hash of the full path of the entry, the same key as PathSlot::hash_
+    u64 time_;   //!< nanoseconds since the archive was opened
+    u32 index_;  //!< entry of the traced archive
+    u16 thread_; //!< threads are numbered in the order of their first access
+    u16 event_;  //!< TraceEvent
+};
+
 //--- Array
 //--------------------------------------------------------
 template<class T>
@@ -114,6 +199,7 @@ public:
     u32 size() const;
     void clear();
     void* get(u32 size);
+    void* get(u32 size, u32 alignment);
 private:
     BufferPool(const BufferPool&) = delete;
     BufferPool& operator=(const BufferPool&) = delete;
@@ -123,26 +209,74 @@ private:
 
 //--- Builder
 //--------------------------------------------------------
+class PacFS;
+
 class Builder
 {
 public:
+    /**
+     * Compression of the files whose path matches a pattern.
+     * Patterns without a separator match the file name, others the path relative to the root.
+     * '*' matches within a directory, '**' across directories and '?' one character.
+     */
+    struct Rule
+    {
+        const char* pattern_;
+        Compression compression_;
+        s32 level_; //!< same meaning as Param::level_
+    };
+
     struct Param
     {
         Compression compression_ = Compression::LZ4;
+        s32 level_ = 0; //!< codec level, 0 uses LZ4HC_CLEVEL_OPT_MIN for LZ4 and ZSTD_CLEVEL_DEFAULT for Zstd, negative selects the fast modes, LZ4_compress_fast accelerates by -level_
         u32 minimum_size_to_compress_ = 512;
+        u32 maximum_ratio_ = 0; //!< percent, entries which compress to more of their size are stored raw, 0 disables
+        u32 dictionary_size_ = 0; //!< capacity of the dictionary trained on small entries, 0 disables
+        u32 dictionary_threshold_ = 8 * 1024; //!< entries up to this size are compressed with the dictionary
+        u32 solid_size_ = 0; //!< files up to this size in the same directory are packed into solid blocks, 0 disables
+        u32 solid_block_size_ = 64 * 1024; //!< uncompressed capacity of a solid block
+        bool path_index_ = true; //!< emit the path hash table for constant time lookups
+        u32 block_size_ = 64 * 1024; //!< files larger than this are split into independently compressed blocks, 0 disables
+        u32 num_threads_ = 1; //!< number of compression workers, 0 uses all hardware threads
+        u64 memory_limit_ = 0; //!< bound of the file contents held in memory at once, caps the block size, 0 disables
+        const char* previous_ = nullptr; //!< archive of a previous build, unchanged files are copied from it without recompression
+        bool deduplicate_ = true; //!< store byte-identical files once, their entries share the data
+        const Rule* rules_ = nullptr; //!< the first matching rule decides, matched files are stored on their own without the dictionary
+        u32 num_rules_ = 0;
+        const char* trace_ = nullptr; //!< access trace of PacFS::Param::trace_, files are stored in the order of their first access
+        u32 alignment_ = 0; //!< entries start at multiples of this power of two within the pack, 0 disables
+        u64 alignment_threshold_ = 0; //!< only entries of at least this uncompressed size are aligned
+    };
+
+    /**
+     * Statistics of the last build.
+     */
+    struct Report
+    {
+        u32 num_duplicates_ = 0; //!< files whose contents were already stored for another entry
+        u64 duplicate_size_ = 0; //!< uncompressed size of those files
+        u64 saved_size_ = 0;     //!< bytes of the data section which they would have taken
+        u64 peak_memory_ = 0;    //!< most bytes of file contents held at once, within Param::memory_limit_ unless a single unit exceeds it
+        u32 num_reused_ = 0;     //!< files copied from Param::previous_ without compressing them again
+        u32 num_rehashed_ = 0;   //!< candidates for reuse which were hashed because their write time changed
     };
 
     Builder();
     ~Builder();
     bool build(const char* root, const char* outfile, const Param& param);
+    const Report& report() const;
 
 private:
     void add_file(u32 index, const std::filesystem::directory_entry& entry);
     void add_directory(u32 index, const std::filesystem::directory_entry& entry, const std::u8string& name);
-    bool compress(const char* file, const Param& param);
+    void build_path_index(Array<PathSlot>& slots) const;
+    bool compress(const char* file, const Param& param, PacFS* previous);
     Array<File> files_;
     Array<char> names_;
     Array<std::filesystem::path> filepath_;
+    Array<s64> mtimes_; //!< last write time of each source file
+    Report report_;
 };
 
 //--- IFileSystem
@@ -191,20 +325,73 @@ private:
     u32 index_;
 };
 
+//--- SharedBuffer
+//-------------------------------------------------------------------
+/**
+ * Reference counted block of memory, the contents follow the header.
+ */
+struct SharedBuffer
+{
+    std::atomic<u32> references_;
+    u64 size_;
+
+    static SharedBuffer* create(u64 size);
+    u8* data();
+    void add_reference();
+    void release();
+};
+
+//--- FileView
+//-------------------------------------------------------------------
+/**
+ * Read-only span over the contents of a file.
+ * Points straight into the archive mapping when possible, otherwise holds a reference to a decompressed copy
+ * which is released with the view.
+ */
+class FileView
+{
+public:
+    FileView();
+    ~FileView();
+    FileView(FileView&& other);
+    FileView& operator=(FileView&& other);
+    operator bool() const;
+    const void* data() const;
+    u64 size() const;
+    void reset();
+
+private:
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+    friend class PhyFile;
+    friend class PacFile;
+    FileView(const void* data, u64 size, SharedBuffer* buffer);
+
+    const void* data_;
+    u64 size_;
+    SharedBuffer* buffer_;
+};
+
 //--- IFile
 //-------------------------------------------------------------------
 class IFile
 {
 public:
     virtual void close() = 0;
-    virtual u32 original_size() const = 0;
-    virtual u32 compressed_size() const = 0;
+    virtual u64 original_size() const = 0;
+    virtual u64 compressed_size() const = 0;
     virtual bool is_file() const = 0;
     virtual u32 num_children() const = 0;
     virtual DirectoryIterator begin() = 0;
     virtual void next(DirectoryIterator& itr) = 0;
     virtual std::u8string_view filename() const = 0;
     virtual u32 read(void* dst) = 0;
+    /**
+     * Read up to size bytes starting at offset.
+     * @return number of bytes read, 0 at or past the end or on failure
+     */
+    virtual u64 read(void* dst, u64 offset, u64 size) = 0;
+    virtual FileView view() = 0;
 protected:
     IFile(const IFile&) = delete;
     IFile& operator=(const IFile&) = delete;
@@ -222,14 +409,16 @@ class PhyFile : public IFile
 public:
     virtual ~PhyFile();
     virtual void close() override;
-    virtual u32 original_size() const override;
-    virtual u32 compressed_size() const override;
+    virtual u64 original_size() const override;
+    virtual u64 compressed_size() const override;
     virtual bool is_file() const override;
     virtual u32 num_children() const override;
     virtual DirectoryIterator begin() override;
     virtual void next(DirectoryIterator& itr) override;
     virtual std::u8string_view filename() const override;
     virtual u32 read(void* dst) override;
+    virtual u64 read(void* dst, u64 offset, u64 size) override;
+    virtual FileView view() override;
 protected:
     PhyFile(const PhyFile&) = delete;
     PhyFile& operator=(const PhyFile&) = delete;
@@ -239,7 +428,7 @@ protected:
     void initialize(PhyFS* fs, const std::filesystem::directory_entry& entry);
     PhyFS* fs_;
     bool is_file_;
-    u32 size_;
+    u64 size_;
     std::u8string filepath_;
     std::u8string filename_;
     Array<std::filesystem::directory_entry> children_;
@@ -290,26 +479,38 @@ private:
 //--- PacFile
 //-------------------------------------------------------------------
 class PacFS;
+struct Scratch;
 class PacFile : public IFile
 {
 public:
     virtual ~PacFile();
     virtual void close() override;
-    virtual u32 original_size() const override;
-    virtual u32 compressed_size() const override;
+    virtual u64 original_size() const override;
+    virtual u64 compressed_size() const override;
     virtual bool is_file() const override;
     virtual u32 num_children() const override;
     virtual DirectoryIterator begin() override;
     virtual void next(DirectoryIterator& itr) override;
     virtual std::u8string_view filename() const override;
     virtual u32 read(void* dst) override;
+    virtual u64 read(void* dst, u64 offset, u64 size) override;
+    virtual FileView view() override;
 protected:
     PacFile(const PacFile&) = delete;
     PacFile& operator=(const PacFile&) = delete;
     friend class PacFS;
+    friend class Builder;
     PacFile();
 
     void initialize(PacFS* fs, const File* file);
+    u32 read(void* dst, Scratch& scratch);
+    u64 read(void* dst, u64 offset, u64 size, Scratch& scratch);
+    FileView view(Scratch& scratch);
+    u32 read_entry(void* dst, Scratch& scratch);
+    u64 read_entry(void* dst, u64 offset, u64 size, Scratch& scratch);
+    u64 read_blocks(void* dst, u64 offset, u64 size, XXH64_state_s* hash_state, Scratch& scratch);
+    u64 read_solid(void* dst, u64 offset, u64 size, Scratch& scratch);
+    bool verify(const void* data) const;
     PacFS* fs_;
     const File* file_;
 };
@@ -322,18 +523,66 @@ public:
     inline static constexpr u32 MaxPath = 512;
     inline static constexpr u32 PageSizeShift = 16;
     inline static constexpr u32 PageSize = 1ULL<<PageSizeShift;
+
+    /**
+     * Expected access to a range of the pack, passed on to posix_fadvise or madvise.
+     */
+    enum class Advice : u8
+    {
+        Normal = 0,
+        Sequential, //!< read ahead aggressively
+        Random,     //!< no read ahead
+        WillNeed,   //!< start reading now
+        DontNeed,   //!< the cached pages may be dropped
+    };
+
+    struct Param
+    {
+        bool memory_map_ = false; //!< map the whole archive read-only instead of reading through stdio
+        u64 cache_size_ = 0; //!< byte budget of the decompressed content cache, 0 disables
+        bool verify_ = false; //!< check File::checksum_ of entries read or viewed whole, failures read nothing
+        const char* trace_ = nullptr; //!< file which receives the opens and reads of files, written by close, nullptr disables
+        bool direct_io_ = false; //!< read large entries past the page cache, through aligned bounce buffers unless entry and destination are aligned
+        u64 direct_threshold_ = 1024 * 1024; //!< smaller entries keep the page cache
+        bool hints_ = false; //!< read ahead the files of iterated directories, scan sequentially in verify(), off leaves the kernel defaults alone
+    };
+
     PacFS();
     virtual ~PacFS();
 
     virtual bool open(const char* filepath) override;
+    bool open(const char* filepath, const Param& param);
     virtual void close() override;
 
     virtual IFile* open_file(const char* filepath) override;
     virtual bool close_file(IFile* file) override;
+
+    /**
+     * Check the whole pack against Header::hash_, chunks are hashed in parallel.
+     * @param num_threads number of hashing threads, 0 uses all hardware threads
+     */
+    bool verify();
+    bool verify(u32 num_threads);
+
+    /**
+     * Hint the access to the whole pack.
+     */
+    void advise(Advice advice);
+
+    /**
+     * Hint the access to the data of a file, or of the files directly in a directory.
+     */
+    void advise(IFile* file, Advice advice);
+
+    /**
+     * Bytes read past the page cache since open, stays 0 where the file system refuses direct I/O.
+     */
+    u64 direct_size() const;
 private:
     PacFS(const PacFS&) = delete;
     PacFS& operator=(const PacFS&) = delete;
     friend class PacFile;
+    friend class Builder;
     struct Page
     {
         Page* next_;
@@ -346,19 +595,92 @@ private:
     };
 
     IFile* open_file(u32 root, const char* begin, const char* end);
+    u32 find_child(const File& directory, const char* name, size_t length) const;
+    IFile* find_file(const char* begin, const char* end);
+    bool match_path(u32 index, const char* begin, const char* end) const;
     PacFile* pop();
     void push(Entry* f);
     void alloc_page();
-    void* get_buffer(u32 size);
-
-    FILE* file_;
+    enum class Buffer : u32
+    {
+        Compressed = 0,
+        Decompressed,
+        Table,
+        Direct,
+        Max,
+    };
+    Scratch* lease_scratch();
+    void release_scratch(Scratch* scratch);
+    void clear_scratch();
+    void* get_buffer(Scratch& scratch, Buffer buffer, u32 size);
+    const u8* load(Scratch& scratch, Buffer buffer, u64 position, u32 size, bool direct);
+
+    /**
+     * Node of the decompressed content cache, most recently used first.
+     */
+    struct CacheNode
+    {
+        CacheNode* prev_;
+        CacheNode* next_;
+        SharedBuffer* buffer_;
+        u32 entry_;
+    };
+    SharedBuffer* acquire_cached(PacFile& file, Scratch& scratch);
+    SharedBuffer* acquire_solid(const File& entry, Scratch& scratch);
+    void clear_cache();
+    void unlink(CacheNode* node);
+    void link_front(CacheNode* node);
+    void record(const File& entry, TraceEvent event);
+    void write_trace();
+    bool aligned(u64 position) const;
+    bool direct(const File& entry) const;
+    bool read_raw(Scratch& scratch, void* dst, u64 size, u64 position, bool direct);
+    bool read_direct(Scratch& scratch, void* dst, u64 size, u64 position);
+    void advise_range(u64 position, u64 size, Advice advice);
+
+    /**
+     * Read the chunk hashes and the build records and check them with the metadata against Header::hash_, fails for original packs.
+     */
+    bool load_chunks(Array<u64>& chunks, Array<BuildRecord>& records);
+
+    std::intptr_t file_; //!< native handle, reads are positional so that threads can share it
+    std::intptr_t direct_; //!< handle for direct I/O, InvalidHandle unless Param::direct_io_
+    u64 direct_threshold_;
+    std::atomic<u64> direct_size_;
+    u32 alignment_;        //!< alignment of aligned entries, 0 if there are none
+    bool hints_;
+    const u8* map_;
+    u64 map_size_;
     Header header_;
-    File* files_;
+    const u8* index_; //!< everything between the header and the data section
+    File* files_;     //!< points into index_ unless the entries of an original pack were widened
     const char* names_;
+    const PathSlot* slots_;
+    Array<u32> parents_; //!< directory of each entry, filled only with the path hash table
     u32 opend_;
     Page* pages_;
     Entry* entries_;
-    BufferPool buffer_pool_;
+    std::mutex mutex_; //!< guards the entry pool and the free scratch buffers
+    Scratch* scratch_; //!< scratch buffers free for the next read
+    const u8* dictionary_;
+    u32 dictionary_size_;
+    ZSTD_DDict_s* zstd_dictionary_;
+    bool verify_;
+    CacheNode** cache_; //!< node of each entry, nullptr when not cached
+    CacheNode* cache_head_;
+    CacheNode* cache_tail_;
+    u64 cache_size_;
+    u64 cache_capacity_;
+    SharedBuffer* solid_; //!< most recently decompressed solid block
+    u64 solid_offset_;
+    std::mutex cache_mutex_; //!< guards the content cache and the solid block
+    bool tracing_;
+    std::filesystem::path trace_file_;
+    u64 trace_start_; //!< steady clock at open in nanoseconds
+    Array<u64> trace_paths_;   //!< path hash of each entry
+    Array<u64> trace_threads_; //!< hashes of the thread ids in the order of their first access
+    Array<TraceRecord> trace_;
+    std::mutex trace_mutex_;
 };
 
 //--- VFS
@@ -371,6 +693,7 @@ public:
 
     bool add_phyfs(const char* root);
     bool add_pacfs(const char* file);
+    bool add_pacfs(const char* file, const PacFS::Param& param);
 
     IFile* open_file(const char* filepath);
     bool close_file(IFile* file);
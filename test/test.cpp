@@ -1,9 +1,123 @@
 #include "catch_amalgamated.hpp"
 #include "../simplefs.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #define EQ_FLOAT(x0, x1) CHECK(std::abs(x0-x1)<1.0e-7f)
 
+// Test data is cantrbry.tar.bz2 extracted into data/, the build does so next to the tests.
+static constexpr const char* DataDirectory = "data";
+
+// Call fn with the full path and the file of every file below a directory, recursively.
+template<class Fn>
+void for_each_file(sfs::IFileSystem& fs, const std::u8string& path, Fn&& fn)
+{
+    sfs::IFile* directory = fs.open_file((const char*)path.c_str());
+    REQUIRE(nullptr != directory);
+    for(auto&& itr = directory->begin(); itr; ++itr){
+        std::u8string child = path + std::u8string(itr->filename());
+        if(itr->is_file()){
+            fn(child, *itr);
+        }else{
+            for_each_file(fs, child + u8"/", fn);
+        }
+    }
+    directory->close();
+}
+
+// Compare every file of expected with the file of the same path in actual, returns the number of files compared.
+uint32_t compare_files(sfs::IFileSystem& expected, sfs::IFileSystem& actual)
+{
+    uint32_t count = 0;
+    for_each_file(expected, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+        sfs::IFile* other = actual.open_file((const char*)path.c_str());
+        REQUIRE(nullptr != other);
+        sfs::FileView a = file.view();
+        sfs::FileView b = other->view();
+        CHECK(a);
+        CHECK(b);
+        CHECK(a.size() == b.size());
+        CHECK((a.size() != b.size() || 0 == a.size() || 0 == ::memcmp(a.data(), b.data(), a.size())));
+        other->close();
+        ++count;
+    });
+    return count;
+}
+
+// Build a pack of the test data and check that it holds every file.
+void build_and_compare(const char* outfile, const sfs::Builder::Param& param, const sfs::PacFS::Param& pack_param = sfs::PacFS::Param())
+{
+    sfs::PhyFS phyfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    sfs::Builder builder;
+    REQUIRE(builder.build(DataDirectory, outfile, param));
+    sfs::PacFS pacfs;
+    REQUIRE(pacfs.open(outfile, pack_param));
+    CHECK(0 < compare_files(phyfs, pacfs));
+}
+
+// Copy a pack and flip its last data byte, which belongs to the last stored entry.
+void corrupt_copy(const char* pack, const char* copy)
+{
+    std::filesystem::copy_file(pack, copy, std::filesystem::copy_options::overwrite_existing);
+    FILE* f = fopen(copy, "r+b");
+    REQUIRE(nullptr != f);
+    sfs::Header header;
+    REQUIRE(1 == fread(&header, sizeof(header), 1, f));
+    fseek(f, static_cast<long>(header.chunks_ - 1), SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, static_cast<long>(header.chunks_ - 1), SEEK_SET);
+    fputc(c ^ 0xFF, f);
+    fclose(f);
+}
+
+// Whole contents of a file.
+std::vector<char> read_bytes(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    REQUIRE(nullptr != f);
+    std::vector<char> bytes;
+    char buffer[4096];
+    for(size_t size; 0 < (size = fread(buffer, 1, sizeof(buffer), f));){
+        bytes.insert(bytes.end(), buffer, buffer + size);
+    }
+    fclose(f);
+    return bytes;
+}
+
+// Header and entries of a pack as they are stored, optionally followed by what lies between the entries and the data.
+std::vector<sfs::File> read_entries(const char* pack, sfs::Header& header, std::string* names = nullptr)
+{
+    FILE* f = fopen(pack, "rb");
+    REQUIRE(nullptr != f);
+    REQUIRE(1 == fread(&header, sizeof(header), 1, f));
+    std::vector<sfs::File> files(header.num_entries_);
+    REQUIRE(1 == fread(&files[0], sizeof(sfs::File) * files.size(), 1, f));
+    if(nullptr != names){
+        names->resize(header.data_ - header.name_);
+        REQUIRE(1 == fread(&(*names)[0], names->size(), 1, f));
+    }
+    fclose(f);
+    return files;
+}
+
+// Build record of each entry of a pack.
+std::vector<sfs::BuildRecord> read_records(const char* pack)
+{
+    std::vector<char> bytes = read_bytes(pack);
+    sfs::Header header;
+    ::memcpy(&header, bytes.data(), sizeof(header));
+    REQUIRE(header.records_ + sizeof(sfs::BuildRecord) * header.num_entries_ <= bytes.size());
+    std::vector<sfs::BuildRecord> records(header.num_entries_);
+    ::memcpy(records.data(), &bytes[header.records_], sizeof(sfs::BuildRecord) * records.size());
+    return records;
+}
+
 TEST_CASE("PhySF" "[physical]")
 {
     sfs::PhyFS phyfs;
@@ -12,10 +126,10 @@ TEST_CASE("PhySF" "[physical]")
     }
     sfs::IFile* file = phyfs.open_file("/");
     for(auto&& itr = file->begin(); itr; ++itr){
-        printf("%s %d\n", &(*itr).filename()[0], (*itr).original_size());
+        printf("%s %llu\n", &(*itr).filename()[0], (unsigned long long)(*itr).original_size());
         if(!itr->is_file()){
             for(auto&& itr2 = itr->begin(); itr2; ++itr2) {
-                printf("  %s %d\n", &(*itr2).filename()[0], (*itr2).original_size());
+                printf("  %s %llu\n", &(*itr2).filename()[0], (unsigned long long)(*itr2).original_size());
             }
         }
     }
@@ -38,6 +152,17 @@ std::ostream& print(std::ostream& os, std::u8string_view str)
     return os;
 }
 
+TEST_CASE("Builder threads" "[build]")
+{
+    // Workers finish in any order, the writer keeps the planned one.
+    sfs::Builder::Param param;
+    param.num_threads_ = 1;
+    build_and_compare("out_thread.pac", param);
+    param.num_threads_ = 16;
+    build_and_compare("out_threads16.pac", param);
+    CHECK(read_bytes("out_thread.pac") == read_bytes("out_threads16.pac"));
+}
+
 TEST_CASE("PacFS" "[pack]")
 {
     sfs::PacFS pacfs;
@@ -73,3 +198,1035 @@ TEST_CASE("PacFS" "[pack]")
     pacfs.close();
 }
 
+
+// Write bytes as a file.
+void write_bytes(const char* path, const std::vector<char>& bytes)
+{
+    FILE* f = fopen(path, "wb");
+    REQUIRE(nullptr != f);
+    CHECK((bytes.empty() || 1 == fwrite(bytes.data(), bytes.size(), 1, f)));
+    fclose(f);
+}
+
+TEST_CASE("PacFS header" "[pack]")
+{
+    // Broken packs are refused at open, mapped or not, instead of being read out of bounds.
+    sfs::Builder::Param build_param;
+    build_and_compare("out_header.pac", build_param);
+    std::vector<char> bytes = read_bytes("out_header.pac");
+    sfs::Header header;
+    ::memcpy(&header, bytes.data(), sizeof(header));
+    std::vector<std::vector<char>> broken;
+    broken.emplace_back();
+    broken.emplace_back(bytes.begin(), bytes.begin() + 10);
+    broken.emplace_back(bytes.begin(), bytes.begin() + sizeof(sfs::Header));
+    broken.emplace_back(bytes.begin(), bytes.begin() + header.data_ - 1);
+    auto corrupt = [&](auto&& fn){
+        sfs::Header h = header;
+        fn(h);
+        std::vector<char> copy = bytes;
+        ::memcpy(copy.data(), &h, sizeof(h));
+        broken.push_back(copy);
+    };
+    corrupt([](sfs::Header& h){ h.magic_ ^= 0xFF; });
+    corrupt([](sfs::Header& h){ h.version_ = sfs::Version + 1; });
+    corrupt([](sfs::Header& h){ h.version_ = sfs::Version - 1; });
+    corrupt([](sfs::Header& h){ h.num_entries_ = 0; });
+    corrupt([](sfs::Header& h){ h.num_entries_ = 0x10000000U; });
+    corrupt([](sfs::Header& h){ h.name_ = h.data_ + 1; });
+    corrupt([](sfs::Header& h){ h.num_slots_ = 3; });
+    corrupt([](sfs::Header& h){ h.data_ = 0xFFFFFF00U; });
+    corrupt([](sfs::Header& h){ h.chunk_size_ = 0; });
+    corrupt([](sfs::Header& h){ h.records_ = h.chunks_ - 1; });
+    for(int i = 0; i < 2; ++i){
+        sfs::PacFS::Param param;
+        param.memory_map_ = 0 != i;
+        sfs::PacFS pacfs;
+        CHECK(pacfs.open("out_header.pac", param));
+        for(size_t j = 0; j < broken.size(); ++j){
+            write_bytes("out_header_broken.pac", broken[j]);
+            INFO("case " << j << " mapped " << i);
+            CHECK_FALSE(pacfs.open("out_header_broken.pac", param));
+        }
+    }
+}
+
+TEST_CASE("PacFS path index" "[pack]")
+{
+    sfs::Builder::Param param;
+    param.path_index_ = true;
+    build_and_compare("out_index.pac", param);
+    sfs::Header header;
+    read_entries("out_index.pac", header);
+    CHECK(0 < header.num_slots_);
+    CHECK(0 == (header.num_slots_ & (header.num_slots_ - 1)));
+    CHECK(header.num_entries_ < header.num_slots_);
+
+    // Lookups go through the table, paths are matched as a whole and not by their last component.
+    sfs::PacFS pacfs;
+    REQUIRE(pacfs.open("out_index.pac"));
+    for(const char* path: {"cantrbry/alice29.txt", "/cantrbry/alice29.txt", "cantrbry", "/cantrbry/"}){
+        sfs::IFile* file = pacfs.open_file(path);
+        CHECK(nullptr != file);
+        if(nullptr != file){
+            file->close();
+        }
+    }
+    for(const char* path: {"alice29.txt", "/cantrbry/alice29", "/cantrbry/alice29.txtx", "/missing/alice29.txt", "cantrbry/missing"}){
+        INFO(path);
+        CHECK(nullptr == pacfs.open_file(path));
+    }
+
+    // Slots which name each other's entry, as colliding paths would, still open the right files.
+    std::string names;
+    std::vector<sfs::File> files = read_entries("out_index.pac", header, &names);
+    sfs::u32 a = header.num_entries_;
+    sfs::u32 b = header.num_entries_;
+    for(sfs::u32 i = 0; i < header.num_entries_; ++i){
+        std::string name = names.substr(files[i].name_offset_, files[i].name_length_);
+        a = "alice29.txt" == name ? i : a;
+        b = "asyoulik.txt" == name ? i : b;
+    }
+    REQUIRE(a < header.num_entries_);
+    REQUIRE(b < header.num_entries_);
+    std::vector<char> bytes = read_bytes("out_index.pac");
+    for(sfs::u32 i = 0; i < header.num_slots_; ++i){
+        sfs::PathSlot slot;
+        ::memcpy(&slot, &bytes[header.index_ + sizeof(sfs::PathSlot) * i], sizeof(sfs::PathSlot));
+        slot.index_ = a == slot.index_ ? b : (b == slot.index_ ? a : slot.index_);
+        ::memcpy(&bytes[header.index_ + sizeof(sfs::PathSlot) * i], &slot, sizeof(sfs::PathSlot));
+    }
+    write_bytes("out_index_swapped.pac", bytes);
+    sfs::PhyFS phyfs;
+    sfs::PacFS swapped;
+    REQUIRE(phyfs.open(DataDirectory));
+    REQUIRE(swapped.open("out_index_swapped.pac"));
+    CHECK(0 < compare_files(phyfs, swapped));
+    CHECK(nullptr == swapped.open_file("cantrbry/missing"));
+}
+
+TEST_CASE("PacFS sorted children" "[pack]")
+{
+    // Without the path index every lookup binary searches the children of each directory.
+    sfs::Builder::Param param;
+    param.path_index_ = false;
+    build_and_compare("out_sorted.pac", param);
+    sfs::Header header;
+    std::string names;
+    std::vector<sfs::File> files = read_entries("out_sorted.pac", header, &names);
+    CHECK(0 == header.num_slots_);
+    CHECK(0 != (header.flags_ & static_cast<sfs::u32>(sfs::HeaderFlag::SortedChildren)));
+    uint32_t directories = 0;
+    for(const sfs::File& entry: files){
+        if(static_cast<sfs::u8>(sfs::Type::Directory) != entry.type_){
+            continue;
+        }
+        ++directories;
+        for(sfs::u64 i = 1; i < entry.children_.num_children_; ++i){
+            const sfs::File& a = files[entry.children_.child_start_ + i - 1];
+            const sfs::File& b = files[entry.children_.child_start_ + i];
+            CHECK(names.compare(a.name_offset_, a.name_length_, names, b.name_offset_, b.name_length_) < 0);
+        }
+    }
+    CHECK(1 < directories);
+
+    // Names before the first, between two and after the last child are not found.
+    sfs::PacFS pacfs;
+    REQUIRE(pacfs.open("out_sorted.pac"));
+    for(const char* path: {"cantrbry/a", "cantrbry/b", "cantrbry/zzz", "cantrbry/alice29.tx", "cantrbry/alice29.txtx", "zzz"}){
+        INFO(path);
+        CHECK(nullptr == pacfs.open_file(path));
+    }
+    for(const char* path: {"cantrbry/alice29.txt", "cantrbry/xargs.1", "cantrbry/asyoulik.txt", "cantrbry"}){
+        sfs::IFile* file = pacfs.open_file(path);
+        CHECK(nullptr != file);
+        if(nullptr != file){
+            file->close();
+        }
+    }
+}
+
+TEST_CASE("PacFS view" "[pack]")
+{
+    // Small files are stored as is and viewed in place, the others through a decompressed copy.
+    sfs::Builder::Param build_param;
+    build_param.minimum_size_to_compress_ = 32 * 1024;
+    sfs::PacFS::Param param;
+    param.memory_map_ = true;
+    build_and_compare("out_view.pac", build_param, param);
+    sfs::PacFS pacfs;
+    REQUIRE(pacfs.open("out_view.pac", param));
+    uint32_t counts[2] = {};
+    for_each_file(pacfs, u8"/", [&](const std::u8string&, sfs::IFile& file){
+        sfs::FileView first = file.view();
+        sfs::FileView second = file.view();
+        CHECK(first);
+        CHECK(first.size() == file.original_size());
+        std::vector<unsigned char> buffer(file.original_size() + 1);
+        CHECK(0 < file.read(buffer.data()));
+        CHECK(0 == ::memcmp(buffer.data(), first.data(), first.size()));
+        bool stored = file.compressed_size() == file.original_size();
+        CHECK(stored == (first.data() == second.data()));
+        ++counts[stored ? 0 : 1];
+    });
+    CHECK(0 < counts[0]);
+    CHECK(0 < counts[1]);
+}
+
+TEST_CASE("PacFS ranged read" "[pack]")
+{
+    sfs::Builder::Param build_param;
+    build_and_compare("out_ranged.pac", build_param);
+    sfs::PhyFS phyfs;
+    sfs::PacFS pacfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    REQUIRE(pacfs.open("out_ranged.pac"));
+    uint32_t count = 0;
+    for_each_file(phyfs, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+        sfs::IFile* packed = pacfs.open_file((const char*)path.c_str());
+        REQUIRE(nullptr != packed);
+        sfs::u64 size = packed->original_size();
+        sfs::FileView expected = file.view();
+        REQUIRE(expected.size() == size);
+        std::vector<unsigned char> chunks(size + 1);
+        sfs::u64 offset = 0;
+        for(;;){
+            sfs::u64 r = packed->read(chunks.data() + offset, offset, 1000);
+            if(r<=0){
+                break;
+            }
+            offset += r;
+        }
+        CHECK(offset == size);
+        CHECK(0 == ::memcmp(expected.data(), chunks.data(), size));
+        CHECK(0 == packed->read(chunks.data(), size, 1));
+        packed->close();
+        ++count;
+    });
+    CHECK(0 < count);
+}
+
+TEST_CASE("PacFS blocked read" "[pack]")
+{
+    // Ranges that start, end and cross inside small blocks decompress only the blocks they touch.
+    constexpr sfs::u64 BlockSize = 4 * 1024;
+    sfs::PhyFS phyfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    for(sfs::Compression compression: {sfs::Compression::LZ4, sfs::Compression::Zstd}){
+        sfs::Builder::Param param;
+        param.compression_ = compression;
+        param.block_size_ = BlockSize;
+        build_and_compare("out_blocked.pac", param);
+
+        sfs::Header header;
+        std::vector<sfs::File> files = read_entries("out_blocked.pac", header);
+        CHECK(BlockSize == header.block_size_);
+        uint32_t blocked = 0;
+        for(const sfs::File& entry: files){
+            if(static_cast<sfs::u8>(sfs::Type::File) == entry.type_ && 0 != (entry.compression_ & static_cast<sfs::u8>(sfs::CompressionFlag::Blocked))){
+                CHECK(static_cast<sfs::u8>(compression) == (entry.compression_ & sfs::CompressionMask));
+                ++blocked;
+            }
+        }
+        CHECK(0 < blocked);
+
+        sfs::PacFS pacfs;
+        REQUIRE(pacfs.open("out_blocked.pac"));
+        uint32_t count = 0;
+        for_each_file(phyfs, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+            sfs::FileView expected = file.view();
+            sfs::u64 size = expected.size();
+            if(size <= 2 * BlockSize){
+                return;
+            }
+            sfs::IFile* packed = pacfs.open_file((const char*)path.c_str());
+            REQUIRE(nullptr != packed);
+            REQUIRE(size == packed->original_size());
+            const sfs::u64 last = (size - 1) / BlockSize * BlockSize;
+            const sfs::u64 ranges[][2] = {
+                {0, BlockSize},                         // exactly the first block
+                {BlockSize - 7, 14},                    // across the first boundary
+                {BlockSize + 100, 200},                 // inside the second block
+                {BlockSize / 2, 2 * BlockSize},         // across two boundaries
+                {last - 3, size - last + 3},            // into the last partial block
+                {last + 1, size - last - 1},            // inside the last partial block
+                {size - 10, 100},                       // past the end
+            };
+            std::vector<unsigned char> buffer(3 * BlockSize);
+            for(const auto& range: ranges){
+                INFO((const char*)path.c_str() << " " << range[0] << " " << range[1]);
+                sfs::u64 expected_size = std::min(range[1], size - range[0]);
+                CHECK(expected_size == packed->read(buffer.data(), range[0], range[1]));
+                CHECK(0 == ::memcmp(static_cast<const unsigned char*>(expected.data()) + range[0], buffer.data(), expected_size));
+            }
+            packed->close();
+            ++count;
+        });
+        CHECK(0 < count);
+    }
+}
+
+TEST_CASE("PacFS threads" "[pack]")
+{
+    // Threads share one pack, whole, ranged and blocked reads use scratch buffers of the pack.
+    sfs::Builder::Param param;
+    param.block_size_ = 64 * 1024;
+    build_and_compare("out_threads.pac", param);
+    sfs::PhyFS phyfs;
+    sfs::PacFS pacfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    REQUIRE(pacfs.open("out_threads.pac"));
+    std::vector<std::u8string> paths;
+    std::vector<std::vector<unsigned char>> contents;
+    for_each_file(phyfs, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+        paths.push_back(path);
+        contents.emplace_back(file.original_size() + 1);
+        CHECK(1 == file.read(contents.back().data()));
+    });
+    REQUIRE(0 < paths.size());
+
+    std::atomic<uint32_t> reads = 0;
+    std::atomic<uint32_t> failures = 0;
+    auto work = [&](size_t seed){
+        std::vector<unsigned char> buffer;
+        for(size_t k = 0; k < paths.size() * 4; ++k){
+            size_t i = (seed + k) % paths.size();
+            sfs::IFile* file = pacfs.open_file((const char*)paths[i].c_str());
+            if(nullptr == file){
+                ++failures;
+                continue;
+            }
+            sfs::u64 size = file->original_size();
+            buffer.assign(size + 1, 0);
+            bool result = 1 == file->read(buffer.data()) && 0 == ::memcmp(buffer.data(), contents[i].data(), size);
+            sfs::u64 offset = size / 3;
+            sfs::u64 length = size / 2;
+            if(0 < length){
+                result = result && length == file->read(buffer.data(), offset, length) && 0 == ::memcmp(buffer.data(), contents[i].data() + offset, length);
+            }
+            failures += result ? 0 : 1;
+            ++reads;
+            file->close();
+        }
+    };
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < 8; ++i){
+        threads.emplace_back(work, i);
+    }
+    for(std::thread& thread: threads){
+        thread.join();
+    }
+    CHECK(0 == failures);
+    CHECK(8 * 4 * paths.size() == reads);
+}
+
+TEST_CASE("PacFS cache" "[pack]")
+{
+    // Views of cached entries share the decompressed copy, without a cache each view decompresses again.
+    sfs::Builder::Param build_param;
+    sfs::PacFS::Param param;
+    param.cache_size_ = 256 * 1024;
+    build_and_compare("out_cache.pac", build_param, param);
+    sfs::PacFS pacfs;
+    sfs::PacFS uncached;
+    REQUIRE(pacfs.open("out_cache.pac", param));
+    REQUIRE(uncached.open("out_cache.pac"));
+    uint32_t shared = 0;
+    for(int pass = 0; pass < 2; ++pass){
+        for_each_file(pacfs, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+            sfs::FileView first = file.view();
+            sfs::FileView second = file.view();
+            CHECK(first);
+            CHECK(second.size() == first.size());
+            CHECK(0 == ::memcmp(first.data(), second.data(), first.size()));
+            bool cached = first.data() == second.data();
+            CHECK(cached == (file.original_size() <= param.cache_size_));
+            shared += cached ? 1 : 0;
+            sfs::IFile* other = uncached.open_file((const char*)path.c_str());
+            REQUIRE(nullptr != other);
+            sfs::FileView a = other->view();
+            sfs::FileView b = other->view();
+            CHECK(a.data() != b.data());
+            other->close();
+        });
+    }
+    CHECK(0 < shared);
+}
+
+TEST_CASE("Builder zstd" "[build]")
+{
+    sfs::Builder::Param param;
+    param.compression_ = sfs::Compression::Zstd;
+    param.level_ = 9;
+    build_and_compare("out_zstd.pac", param);
+
+    // Whatever is compressed went through zstd.
+    sfs::Header header;
+    std::vector<sfs::File> files = read_entries("out_zstd.pac", header);
+    uint32_t compressed = 0;
+    for(const sfs::File& entry: files){
+        if(static_cast<sfs::u8>(sfs::Type::File) != entry.type_ || static_cast<sfs::u8>(sfs::Compression::Raw) == entry.compression_){
+            continue;
+        }
+        CHECK(static_cast<sfs::u8>(sfs::Compression::Zstd) == (entry.compression_ & sfs::CompressionMask));
+        ++compressed;
+    }
+    CHECK(0 < compressed);
+}
+
+TEST_CASE("Builder dictionary" "[build]")
+{
+    // Many small records which look alike, the dictionary holds what they share.
+    const char* root = "data_dictionary";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories("data_dictionary/records");
+    static const char* colors[] = {"red", "green", "blue", "yellow", "white"};
+    for(uint32_t i = 0; i < 400; ++i){
+        char path[64];
+        snprintf(path, sizeof(path), "data_dictionary/records/%03u.json", i);
+        FILE* f = fopen(path, "wb");
+        REQUIRE(nullptr != f);
+        fprintf(f, "{\n  \"id\": %u,\n  \"name\": \"record number %u\",\n  \"color\": \"%s\",\n  \"tags\": [", i, i * 7919 % 1000, colors[i % 5]);
+        for(uint32_t j = 0; j < i % 13; ++j){
+            fprintf(f, "%s\"tag-%u\"", 0 < j ? ", " : "", (i + j) % 17);
+        }
+        fprintf(f, "],\n  \"description\": \"a small file of the dictionary test, compressed with the shared dictionary\"\n}\n");
+        fclose(f);
+    }
+    sfs::Builder builder;
+    sfs::Builder::Param param;
+    param.deduplicate_ = false;
+    REQUIRE(builder.build(root, "out_no_dictionary.pac", param));
+    param.dictionary_size_ = 4 * 1024;
+    REQUIRE(builder.build(root, "out_dictionary.pac", param));
+
+    sfs::PhyFS phyfs;
+    sfs::PacFS pacfs;
+    REQUIRE(phyfs.open(root));
+    REQUIRE(pacfs.open("out_dictionary.pac"));
+    CHECK(400 == compare_files(phyfs, pacfs));
+    CHECK(read_bytes("out_dictionary.pac").size() < read_bytes("out_no_dictionary.pac").size());
+
+    // Files below the minimum size to compress use the dictionary too.
+    sfs::Header header;
+    std::vector<sfs::File> files = read_entries("out_dictionary.pac", header);
+    CHECK(0 < header.dictionary_size_);
+    uint32_t small = 0;
+    for(const sfs::File& entry: files){
+        bool dictionary = 0 != (entry.compression_ & static_cast<sfs::u8>(sfs::CompressionFlag::Dictionary));
+        if(static_cast<sfs::u8>(sfs::Type::File) == entry.type_ && dictionary && entry.size_offset_.original_size_ <= param.minimum_size_to_compress_){
+            CHECK(entry.size_offset_.compressed_size_ < entry.size_offset_.original_size_);
+            ++small;
+        }
+    }
+    CHECK(0 < small);
+}
+
+TEST_CASE("Builder solid" "[build]")
+{
+    sfs::Builder::Param param;
+    param.solid_size_ = 16 * 1024;
+    build_and_compare("out_solid.pac", param);
+
+    // The small files share blocks, every member points at the whole block.
+    sfs::Header header;
+    std::vector<sfs::File> files = read_entries("out_solid.pac", header);
+    uint32_t members = 0;
+    for(const sfs::File& entry: files){
+        if(static_cast<sfs::u8>(sfs::Type::File) != entry.type_){
+            continue;
+        }
+        bool solid = 0 != (entry.compression_ & static_cast<sfs::u8>(sfs::CompressionFlag::Solid));
+        CHECK(solid == (entry.size_offset_.original_size_ <= param.solid_size_));
+        if(!solid){
+            continue;
+        }
+        uint32_t siblings = 0;
+        for(const sfs::File& other: files){
+            if(static_cast<sfs::u8>(sfs::Type::File) == other.type_ && other.size_offset_.offset_ == entry.size_offset_.offset_){
+                CHECK(other.compression_ == entry.compression_);
+                CHECK(other.size_offset_.compressed_size_ == entry.size_offset_.compressed_size_);
+                ++siblings;
+            }
+        }
+        CHECK(1 < siblings);
+        ++members;
+    }
+    CHECK(1 < members);
+}
+
+TEST_CASE("Builder deduplicate" "[build]")
+{
+    // The test data with copies of two of its files in another directory.
+    const char* root = "data_dedup";
+    std::filesystem::remove_all(root);
+    std::filesystem::copy(DataDirectory, root, std::filesystem::copy_options::recursive);
+    std::filesystem::create_directory("data_dedup/copy");
+    std::filesystem::copy_file("data_dedup/cantrbry/alice29.txt", "data_dedup/copy/alice29.txt");
+    std::filesystem::copy_file("data_dedup/cantrbry/sum", "data_dedup/copy/sum");
+    sfs::Builder builder;
+    sfs::Builder::Param param;
+    param.deduplicate_ = true;
+    REQUIRE(builder.build(root, "out_dedup.pac", param));
+    const sfs::Builder::Report& report = builder.report();
+    CHECK(2 == report.num_duplicates_);
+    CHECK(152089 + 38240 == report.duplicate_size_);
+    CHECK(0 < report.saved_size_);
+    sfs::PhyFS phyfs;
+    sfs::PacFS dedup;
+    REQUIRE(phyfs.open(root));
+    REQUIRE(dedup.open("out_dedup.pac"));
+    CHECK(0 < compare_files(phyfs, dedup));
+
+    // Both copies of a file point at the same data.
+    sfs::Header header;
+    std::string names;
+    std::vector<sfs::File> files = read_entries("out_dedup.pac", header, &names);
+    for(const char* name: {"alice29.txt", "sum"}){
+        std::vector<const sfs::File*> copies;
+        for(const sfs::File& entry: files){
+            if(static_cast<sfs::u8>(sfs::Type::File) == entry.type_ && names.substr(entry.name_offset_, entry.name_length_) == name){
+                copies.push_back(&entry);
+            }
+        }
+        REQUIRE(2 == copies.size());
+        CHECK(copies[0]->size_offset_.offset_ == copies[1]->size_offset_.offset_);
+        CHECK(copies[0]->size_offset_.compressed_size_ == copies[1]->size_offset_.compressed_size_);
+        CHECK(copies[0]->checksum_ == copies[1]->checksum_);
+    }
+}
+
+TEST_CASE("PacFS sizes" "[pack]")
+{
+    sfs::Builder::Param param;
+    build_and_compare("out_sizes.pac", param);
+    sfs::PhyFS phyfs;
+    sfs::PacFS pacfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    REQUIRE(pacfs.open("out_sizes.pac"));
+    uint32_t count = 0;
+    for_each_file(phyfs, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+        sfs::IFile* packed = pacfs.open_file((const char*)path.c_str());
+        REQUIRE(nullptr != packed);
+        uint64_t size = packed->original_size();
+        CHECK(size == file.original_size());
+        CHECK(0 == file.read(nullptr, size, 1));
+        CHECK(0 == packed->read(nullptr, size, 1));
+        packed->close();
+        ++count;
+    });
+    CHECK(0 < count);
+}
+
+TEST_CASE("PacFS original format" "[pack]")
+{
+    // baseline.pac was written by the first version of Builder from baseline/, before packs had a version.
+    for(int i = 0; i < 2; ++i){
+        sfs::PacFS::Param param;
+        param.memory_map_ = 0 != i;
+        param.verify_ = true;
+        sfs::PhyFS phyfs;
+        sfs::PacFS pacfs;
+        REQUIRE(phyfs.open("baseline"));
+        REQUIRE(pacfs.open("baseline.pac", param));
+        CHECK(4 == compare_files(phyfs, pacfs));
+        CHECK(nullptr == pacfs.open_file("missing.txt"));
+        CHECK(pacfs.verify());
+        CHECK(pacfs.verify(1));
+    }
+    std::vector<char> bytes = read_bytes("baseline.pac");
+    bytes.back() ^= 0xFF;
+    FILE* f = fopen("out_baseline_corrupt.pac", "wb");
+    REQUIRE(nullptr != f);
+    REQUIRE(1 == fwrite(bytes.data(), bytes.size(), 1, f));
+    fclose(f);
+    sfs::PacFS corrupt;
+    REQUIRE(corrupt.open("out_baseline_corrupt.pac"));
+    CHECK_FALSE(corrupt.verify());
+}
+
+TEST_CASE("Builder memory limit" "[build]")
+{
+    sfs::Builder::Param param;
+    param.block_size_ = 0;
+    param.num_threads_ = 4;
+    sfs::Builder builder;
+    REQUIRE(builder.build(DataDirectory, "out_unlimited.pac", param));
+    sfs::u64 unlimited = builder.report().peak_memory_;
+
+    // The same build holds no more than the limit, well below what it takes without one.
+    param.memory_limit_ = 256 * 1024;
+    REQUIRE(builder.build(DataDirectory, "out_limit.pac", param));
+    sfs::u64 peak = builder.report().peak_memory_;
+    CHECK(0 < peak);
+    CHECK(peak <= param.memory_limit_);
+    CHECK(param.memory_limit_ < unlimited);
+
+    sfs::PhyFS phyfs;
+    sfs::PacFS limit;
+    REQUIRE(phyfs.open(DataDirectory));
+    REQUIRE(limit.open("out_limit.pac"));
+    CHECK(0 < compare_files(phyfs, limit));
+}
+
+TEST_CASE("Builder pipeline" "[build]")
+{
+    // Many workers on small blocks under a tight limit wait on each other, the pack stays the same.
+    sfs::PhyFS phyfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    for(sfs::Compression compression: {sfs::Compression::LZ4, sfs::Compression::Zstd}){
+        sfs::Builder::Param param;
+        param.compression_ = compression;
+        param.block_size_ = 4 * 1024;
+        param.memory_limit_ = 64 * 1024;
+        param.num_threads_ = 1;
+        sfs::Builder builder;
+        REQUIRE(builder.build(DataDirectory, "out_pipeline1.pac", param));
+        param.num_threads_ = 16;
+        REQUIRE(builder.build(DataDirectory, "out_pipeline16.pac", param));
+        sfs::u64 peak = builder.report().peak_memory_;
+        CHECK(0 < peak);
+        CHECK(peak <= param.memory_limit_);
+        CHECK(read_bytes("out_pipeline1.pac") == read_bytes("out_pipeline16.pac"));
+
+        sfs::PacFS pacfs;
+        REQUIRE(pacfs.open("out_pipeline16.pac"));
+        CHECK(0 < compare_files(phyfs, pacfs));
+    }
+}
+
+TEST_CASE("Builder maximum ratio" "[build]")
+{
+    // Nothing compresses to one percent, so every entry is stored raw.
+    sfs::Builder::Param param;
+    param.maximum_ratio_ = 1;
+    build_and_compare("out_raw.pac", param);
+    sfs::PacFS raw;
+    REQUIRE(raw.open("out_raw.pac"));
+    for_each_file(raw, u8"/", [](const std::u8string&, sfs::IFile& file){
+        CHECK(file.compressed_size() == file.original_size());
+    });
+
+    // Raw entries remember the codec which missed the ratio, so later builds can take them over.
+    sfs::Header header;
+    std::vector<sfs::File> files = read_entries("out_raw.pac", header);
+    std::vector<sfs::BuildRecord> records = read_records("out_raw.pac");
+    uint32_t rejected = 0;
+    for(size_t i = 0; i < files.size(); ++i){
+        if(static_cast<sfs::u8>(sfs::Type::File) == files[i].type_ && 0 != records[i].rejected_){
+            CHECK(static_cast<sfs::u8>(sfs::Compression::Raw) == files[i].compression_);
+            CHECK(static_cast<sfs::u8>(sfs::Compression::LZ4) == (records[i].rejected_ & sfs::CompressionMask));
+            CHECK(param.maximum_ratio_ < records[i].ratio_);
+            ++rejected;
+        }
+    }
+    CHECK(0 < rejected);
+    param.previous_ = "out_raw.pac";
+    build_and_compare("out_raw_reused.pac", param);
+    CHECK(read_bytes("out_raw.pac") == read_bytes("out_raw_reused.pac"));
+
+    // A looser ratio compresses the entries again.
+    param.maximum_ratio_ = 90;
+    param.previous_ = nullptr;
+    build_and_compare("out_ratio.pac", param);
+    param.previous_ = "out_raw.pac";
+    build_and_compare("out_ratio_reused.pac", param);
+    CHECK(read_bytes("out_ratio.pac") == read_bytes("out_ratio_reused.pac"));
+}
+
+TEST_CASE("Builder rules" "[build]")
+{
+    // LZ4 fast mode by default, zstd for text and spreadsheets stored as is.
+    static const sfs::Builder::Rule rules[] = {
+        {"*.xls", sfs::Compression::Raw, 0},
+        {"cantrbry/*.txt", sfs::Compression::Zstd, 3},
+    };
+    sfs::Builder::Param param;
+    param.level_ = -8;
+    param.rules_ = rules;
+    param.num_rules_ = 2;
+    build_and_compare("out_rules.pac", param);
+
+    sfs::Header header;
+    std::string names;
+    std::vector<sfs::File> files = read_entries("out_rules.pac", header, &names);
+    uint32_t counts[3] = {};
+    for(const sfs::File& entry: files){
+        if(static_cast<sfs::u8>(sfs::Type::File) != entry.type_){
+            continue;
+        }
+        std::string name = names.substr(entry.name_offset_, entry.name_length_);
+        sfs::u8 compression = entry.compression_ & sfs::CompressionMask;
+        if(name.ends_with(".xls")){
+            CHECK(static_cast<sfs::u8>(sfs::Compression::Raw) == entry.compression_);
+            ++counts[0];
+        }else if(name.ends_with(".txt")){
+            CHECK(static_cast<sfs::u8>(sfs::Compression::Zstd) == compression);
+            ++counts[1];
+        }else if(param.minimum_size_to_compress_ < entry.size_offset_.original_size_){
+            CHECK(static_cast<sfs::u8>(sfs::Compression::LZ4) == compression);
+            ++counts[2];
+        }
+    }
+    CHECK(0 < counts[0]);
+    CHECK(0 < counts[1]);
+    CHECK(0 < counts[2]);
+}
+
+TEST_CASE("Builder incremental" "[build]")
+{
+    // A copy of the test data with one file changed after the first build.
+    const char* root = "data_incremental";
+    std::filesystem::remove_all(root);
+    std::filesystem::copy(DataDirectory, root, std::filesystem::copy_options::recursive);
+    sfs::Builder::Param param;
+    param.compression_ = sfs::Compression::Zstd;
+    param.level_ = 19;
+    sfs::Builder builder;
+    REQUIRE(builder.build(root, "out_incremental_base.pac", param));
+    FILE* f = fopen("data_incremental/cantrbry/grammar.lsp", "ab");
+    REQUIRE(nullptr != f);
+    fputs("; changed\n", f);
+    fclose(f);
+
+    REQUIRE(builder.build(root, "out_incremental_fresh.pac", param));
+    CHECK(0 == builder.report().num_reused_);
+
+    param.previous_ = "out_incremental_base.pac";
+    REQUIRE(builder.build(root, "out_incremental.pac", param));
+    sfs::u32 num_reused = builder.report().num_reused_;
+    CHECK(0 < num_reused);
+    CHECK(0 == builder.report().num_rehashed_);
+    CHECK(read_bytes("out_incremental_fresh.pac") == read_bytes("out_incremental.pac"));
+    sfs::PhyFS phyfs;
+    sfs::PacFS pacfs;
+    REQUIRE(phyfs.open(root));
+    REQUIRE(pacfs.open("out_incremental.pac"));
+    CHECK(num_reused < compare_files(phyfs, pacfs));
+
+    // Entries in a damaged chunk of the previous pack are compressed again.
+    corrupt_copy("out_incremental_base.pac", "out_incremental_corrupt.pac");
+    param.previous_ = "out_incremental_corrupt.pac";
+    REQUIRE(builder.build(root, "out_incremental_repaired.pac", param));
+    CHECK(builder.report().num_reused_ < num_reused);
+    CHECK(read_bytes("out_incremental_fresh.pac") == read_bytes("out_incremental_repaired.pac"));
+
+    // Files written since are hashed, the same contents are still reused and changed ones of the same size are not.
+    const char* touched = "data_incremental/cantrbry/fields.c";
+    const char* rewritten = "data_incremental/cantrbry/cp.html";
+    std::vector<char> bytes = read_bytes(rewritten);
+    bytes[0] ^= 0x01;
+    write_bytes(rewritten, bytes);
+    for(const char* path: {touched, rewritten}){
+        std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::hours(1));
+    }
+    param.previous_ = nullptr;
+    REQUIRE(builder.build(root, "out_incremental_touched_fresh.pac", param));
+    param.previous_ = "out_incremental_base.pac";
+    REQUIRE(builder.build(root, "out_incremental_touched.pac", param));
+    CHECK(num_reused - 1 == builder.report().num_reused_);
+    CHECK(2 == builder.report().num_rehashed_);
+    CHECK(read_bytes("out_incremental_touched_fresh.pac") == read_bytes("out_incremental_touched.pac"));
+}
+
+TEST_CASE("Builder reuse level" "[build]")
+{
+    // Entries of a fast build are compressed again at a higher level, the result is the same as a fresh build.
+    sfs::Builder::Param fast;
+    fast.level_ = -10;
+    build_and_compare("out_fast.pac", fast);
+    sfs::Builder::Param param;
+    param.level_ = 12;
+    build_and_compare("out_level.pac", param);
+    param.previous_ = "out_fast.pac";
+    build_and_compare("out_level_reused.pac", param);
+    CHECK(read_bytes("out_level.pac") == read_bytes("out_level_reused.pac"));
+
+    sfs::Header header;
+    std::vector<sfs::File> files = read_entries("out_level.pac", header);
+    std::vector<sfs::BuildRecord> records = read_records("out_level.pac");
+    uint32_t count = 0;
+    for(size_t i = 0; i < files.size(); ++i){
+        if(static_cast<sfs::u8>(sfs::Type::File) == files[i].type_ && static_cast<sfs::u8>(sfs::Compression::LZ4) == (files[i].compression_ & sfs::CompressionMask)){
+            CHECK(12 == records[i].level_);
+            ++count;
+        }
+    }
+    CHECK(0 < count);
+}
+
+TEST_CASE("PacFS trace" "[pack]")
+{
+    // Access the last two files of the tree in reverse order, the traced build stores them first in that order.
+    sfs::Builder::Param build_param;
+    build_and_compare("out_untraced.pac", build_param);
+    std::u8string names[2];
+    {
+        sfs::PacFS::Param param;
+        param.trace_ = "out.trace";
+        sfs::PacFS pacfs;
+        REQUIRE(pacfs.open("out_untraced.pac", param));
+        for_each_file(pacfs, u8"/", [&](const std::u8string& path, sfs::IFile&){
+            names[0] = names[1];
+            names[1] = path;
+        });
+        REQUIRE(!names[0].empty());
+        for(int i = 1; 0 <= i; --i){
+            sfs::IFile* file = pacfs.open_file((const char*)names[i].c_str());
+            REQUIRE(nullptr != file);
+            CHECK(file->view());
+            file->close();
+        }
+        // Other threads get their own numbers, both stay joinable so that their ids differ.
+        auto open = [&](int i){
+            sfs::IFile* file = pacfs.open_file((const char*)names[i].c_str());
+            if(nullptr != file){
+                file->close();
+            }
+        };
+        std::thread thread0(open, 0);
+        std::thread thread1(open, 1);
+        thread0.join();
+        thread1.join();
+    }
+    FILE* f = fopen("out.trace", "rb");
+    REQUIRE(nullptr != f);
+    sfs::TraceHeader header;
+    sfs::TraceRecord records[7];
+    REQUIRE(1 == fread(&header, sizeof(header), 1, f));
+    REQUIRE(6 == fread(records, sizeof(sfs::TraceRecord), 7, f));
+    fclose(f);
+    CHECK(sfs::TraceMagic == header.magic_);
+    CHECK(static_cast<sfs::u16>(sfs::TraceEvent::Open) == records[0].event_);
+    CHECK(static_cast<sfs::u16>(sfs::TraceEvent::Read) == records[1].event_);
+    CHECK(records[0].index_ == records[1].index_);
+    CHECK(records[2].index_ == records[3].index_);
+    CHECK(records[0].time_ <= records[3].time_);
+    CHECK(0 == records[3].thread_);
+    CHECK(3 == records[4].thread_ + records[5].thread_);
+    CHECK(records[4].thread_ != records[5].thread_);
+
+    sfs::Builder::Param param;
+    param.trace_ = "out.trace";
+    build_and_compare("out_trace.pac", param);
+    sfs::Header pack;
+    std::vector<sfs::File> files = read_entries("out_trace.pac", pack);
+    const sfs::File& first = files[records[0].index_];
+    const sfs::File& second = files[records[2].index_];
+    CHECK(0 == first.size_offset_.offset_);
+    CHECK((first.size_offset_.compressed_size_ == second.size_offset_.offset_ || first.checksum_ == second.checksum_));
+
+    sfs::PacFS traced;
+    REQUIRE(traced.open("out_trace.pac"));
+    CHECK(traced.verify());
+}
+
+TEST_CASE("Builder alignment" "[build]")
+{
+    sfs::Builder::Param param;
+    param.compression_ = sfs::Compression::Raw;
+    param.alignment_ = 4096;
+    build_and_compare("out_aligned.pac", param);
+    sfs::Header header;
+    std::vector<sfs::File> files = read_entries("out_aligned.pac", header);
+    CHECK(12 == ((header.flags_ >> sfs::AlignmentShift) & 0xFFU));
+    for(const sfs::File& entry: files){
+        if(static_cast<sfs::u8>(sfs::Type::File) == entry.type_ && 0 < entry.size_offset_.original_size_){
+            CHECK(0 == ((header.data_ + entry.size_offset_.offset_) & 4095));
+        }
+    }
+
+    // Reads into aligned buffers take the direct path, views of the mapping start at page boundaries.
+    sfs::PhyFS phyfs;
+    sfs::PacFS::Param direct_param;
+    direct_param.direct_io_ = true;
+    sfs::PacFS direct;
+    sfs::PacFS::Param map_param;
+    map_param.memory_map_ = true;
+    sfs::PacFS mapped;
+    REQUIRE(phyfs.open(DataDirectory));
+    REQUIRE(direct.open("out_aligned.pac", direct_param));
+    REQUIRE(mapped.open("out_aligned.pac", map_param));
+    CHECK(direct.verify());
+    uint32_t count = 0;
+    for_each_file(direct, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+        sfs::IFile* expected = phyfs.open_file((const char*)path.c_str());
+        sfs::IFile* view = mapped.open_file((const char*)path.c_str());
+        REQUIRE(nullptr != expected);
+        REQUIRE(nullptr != view);
+        sfs::u64 size = file.original_size();
+        std::vector<unsigned char> storage(size + 4096);
+        void* buffer = storage.data() + ((4096 - (reinterpret_cast<std::uintptr_t>(storage.data()) & 4095)) & 4095);
+        CHECK(1 == file.read(buffer));
+        sfs::FileView a = view->view();
+        sfs::FileView b = expected->view();
+        CHECK(a.size() == b.size());
+        CHECK(0 == ::memcmp(buffer, b.data(), b.size()));
+        CHECK(0 == ::memcmp(a.data(), b.data(), b.size()));
+        CHECK((0 == size || 0 == (reinterpret_cast<std::uintptr_t>(a.data()) & 4095)));
+        view->close();
+        expected->close();
+        ++count;
+    });
+    CHECK(0 < count);
+    CHECK(0 < direct.direct_size());
+}
+
+TEST_CASE("PacFS direct" "[pack]")
+{
+    // Every entry of an unaligned pack goes through the bounce buffers.
+    sfs::Builder::Param build_param;
+    sfs::PacFS::Param param;
+    param.direct_io_ = true;
+    param.direct_threshold_ = 0;
+    build_and_compare("out_direct.pac", build_param, param);
+    sfs::PacFS direct;
+    REQUIRE(direct.open("out_direct.pac", param));
+    CHECK(0 == direct.direct_size());
+    CHECK(direct.verify());
+    sfs::u64 verified = direct.direct_size();
+    CHECK(0 < verified);
+
+    sfs::PhyFS phyfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    uint32_t count = 0;
+    for_each_file(phyfs, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+        sfs::IFile* packed = direct.open_file((const char*)path.c_str());
+        REQUIRE(nullptr != packed);
+        sfs::FileView b = file.view();
+        sfs::u64 offset = b.size() / 3;
+        sfs::u64 size = b.size() - offset;
+        std::vector<unsigned char> range(size + 1);
+        CHECK(size == packed->read(range.data(), offset, size));
+        CHECK(0 == ::memcmp(range.data(), static_cast<const unsigned char*>(b.data()) + offset, size));
+        packed->close();
+        ++count;
+    });
+    CHECK(0 < count);
+    CHECK(verified < direct.direct_size());
+
+    // The buffered handle serves everything without the option.
+    sfs::PacFS buffered;
+    REQUIRE(buffered.open("out_direct.pac"));
+    CHECK(buffered.verify());
+    CHECK(0 < compare_files(phyfs, buffered));
+    CHECK(0 == buffered.direct_size());
+}
+
+TEST_CASE("PacFS advise" "[pack]")
+{
+    // Hints are opt-in and never change what is read, with or without a mapping.
+    CHECK_FALSE(sfs::PacFS::Param().hints_);
+    sfs::Builder::Param build_param;
+    build_and_compare("out_advise.pac", build_param);
+    sfs::PhyFS phyfs;
+    REQUIRE(phyfs.open(DataDirectory));
+    for(int i = 0; i < 4; ++i){
+        sfs::PacFS::Param param;
+        param.memory_map_ = 0 != (i & 1);
+        param.hints_ = 0 != (i & 2);
+        sfs::PacFS pacfs;
+        REQUIRE(pacfs.open("out_advise.pac", param));
+        pacfs.advise(sfs::PacFS::Advice::Sequential);
+        CHECK(pacfs.verify());
+        pacfs.advise(sfs::PacFS::Advice::Random);
+        uint32_t count = 0;
+        for_each_file(phyfs, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+            sfs::IFile* packed = pacfs.open_file((const char*)path.c_str());
+            REQUIRE(nullptr != packed);
+            pacfs.advise(packed, sfs::PacFS::Advice::WillNeed);
+            sfs::FileView expected = file.view();
+            std::vector<unsigned char> buffer(packed->original_size() + 1);
+            CHECK(1 == packed->read(buffer.data()));
+            CHECK(0 == ::memcmp(expected.data(), buffer.data(), expected.size()));
+            pacfs.advise(packed, sfs::PacFS::Advice::DontNeed);
+            sfs::FileView view = packed->view();
+            CHECK(view.size() == expected.size());
+            CHECK(0 == ::memcmp(view.data(), expected.data(), expected.size()));
+            packed->close();
+            ++count;
+        });
+        CHECK(0 < count);
+        // Directories hint their files, iterating the pack hints them too when enabled.
+        sfs::IFile* root = pacfs.open_file("/");
+        pacfs.advise(root, sfs::PacFS::Advice::WillNeed);
+        root->close();
+        CHECK(0 < compare_files(pacfs, phyfs));
+        pacfs.advise(sfs::PacFS::Advice::Normal);
+    }
+}
+
+TEST_CASE("PacFS verify" "[pack]")
+{
+    sfs::Builder::Param build_param;
+    sfs::PacFS::Param param;
+    param.verify_ = true;
+    build_and_compare("out_verify.pac", build_param, param);
+
+    // Only the entry whose data was hit fails, every other one still reads.
+    corrupt_copy("out_verify.pac", "out_corrupt.pac");
+    sfs::PacFS corrupt;
+    sfs::PacFS unchecked;
+    REQUIRE(corrupt.open("out_corrupt.pac", param));
+    REQUIRE(unchecked.open("out_corrupt.pac"));
+    uint32_t count = 0;
+    uint32_t failures = 0;
+    for_each_file(corrupt, u8"/", [&](const std::u8string& path, sfs::IFile& file){
+        std::vector<unsigned char> buffer(file.original_size() + 1);
+        bool failed = 0 == file.read(buffer.data());
+        CHECK(failed == !file.view());
+        failures += failed ? 1 : 0;
+        ++count;
+        sfs::IFile* other = unchecked.open_file((const char*)path.c_str());
+        REQUIRE(nullptr != other);
+        std::vector<unsigned char> data(file.original_size() + 1);
+        if(!failed){
+            CHECK(1 == other->read(data.data()));
+            CHECK(0 == ::memcmp(data.data(), buffer.data(), file.original_size()));
+        }
+        other->close();
+    });
+    CHECK(1 == failures);
+    CHECK(1 < count);
+}
+
+TEST_CASE("PacFS verify pack" "[pack]")
+{
+    sfs::Builder::Param build_param;
+    build_and_compare("out_verify_pack.pac", build_param);
+    corrupt_copy("out_verify_pack.pac", "out_corrupt_pack.pac");
+
+    // The build records are covered too, the builder trusts them when it reuses entries.
+    std::vector<char> bytes = read_bytes("out_verify_pack.pac");
+    sfs::Header header;
+    ::memcpy(&header, bytes.data(), sizeof(header));
+    bytes[header.records_ + sizeof(sfs::BuildRecord)] ^= 0x01;
+    write_bytes("out_corrupt_records.pac", bytes);
+
+    // So is the header, a different block size or layout would misread the entries.
+    std::vector<char> block_size = read_bytes("out_verify_pack.pac");
+    sfs::Header h = header;
+    h.block_size_ ^= 0x1000;
+    ::memcpy(block_size.data(), &h, sizeof(h));
+    write_bytes("out_corrupt_block_size.pac", block_size);
+    std::vector<char> flags = read_bytes("out_verify_pack.pac");
+    h = header;
+    h.flags_ ^= static_cast<sfs::u32>(sfs::HeaderFlag::SortedChildren);
+    ::memcpy(flags.data(), &h, sizeof(h));
+    write_bytes("out_corrupt_flags.pac", flags);
+    for(int i = 0; i < 2; ++i){
+        sfs::PacFS::Param param;
+        param.memory_map_ = 0 != i;
+        sfs::PacFS pacfs;
+        REQUIRE(pacfs.open("out_verify_pack.pac", param));
+        CHECK(pacfs.verify());
+        CHECK(pacfs.verify(1));
+        for(const char* path: {"out_corrupt_pack.pac", "out_corrupt_records.pac", "out_corrupt_block_size.pac", "out_corrupt_flags.pac"}){
+            INFO(path << " mapped " << i);
+            sfs::PacFS corrupt;
+            REQUIRE(corrupt.open(path, param));
+            CHECK_FALSE(corrupt.verify());
+            CHECK_FALSE(corrupt.verify(1));
+        }
+    }
+}